@@ -0,0 +1,550 @@
+#include "9png-batch.hpp"
+#include "9png.hpp"
+#include "9png-cache.hpp"
+#include "android-bundle.hpp"
+#include "mapped-file.hpp"
+#include "sha256.hpp"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <cstdio>
+#include <cstdlib>
+
+using ::std::string;
+using ::std::vector;
+
+static bool ends_with(string const &str, string const &suffix)
+{
+    return str.length() >= suffix.length() &&
+           str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+}
+
+static bool is_directory(string const &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool is_file(string const &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static void make_dirs(string const &path)
+{
+    for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1))
+    {
+        mkdir(path.substr(0, pos).c_str(), 0755);
+    }
+}
+
+// 递归列出目录下的所有文件, 返回相对路径.
+// 指向目录的符号链接不进入, 避免指回上级目录时无限递归
+static void list_files(string const &root, string const &rel, vector<string> &out)
+{
+    string dirpath = rel.empty() ? root : root + "/" + rel;
+    DIR *dir = opendir(dirpath.c_str());
+    if (!dir)
+    {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        string name = ent->d_name;
+        if (name == "." || name == "..")
+        {
+            continue;
+        }
+        string child = rel.empty() ? name : rel + "/" + name;
+        string path = root + "/" + child;
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            list_files(root, child, out);
+        }
+        else if (!S_ISLNK(st.st_mode) || !is_directory(path))
+        {
+            out.push_back(child);
+        }
+    }
+    closedir(dir);
+}
+
+static bool collect_manifest(string const &source, vector<Aapt9PNGJob> &jobs)
+{
+    ::std::ifstream stm(source);
+    if (!stm)
+    {
+        return false;
+    }
+
+    string line;
+    while (::std::getline(stm, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        Aapt9PNGJob job;
+        ::std::istringstream fields(line);
+        if (fields >> job.pkgpng >> job.json >> job.png)
+        {
+            jobs.push_back(job);
+        }
+    }
+    return true;
+}
+
+bool CollectAapt9PNGJobs(string const &source, string const &outdir, bool decodeMode,
+                         Bundle const *bundle, vector<Aapt9PNGJob> &jobs)
+{
+    if (is_file(source))
+    {
+        return collect_manifest(source, jobs);
+    }
+    if (!is_directory(source))
+    {
+        return false;
+    }
+
+    vector<string> files;
+    list_files(source, "", files);
+    ::std::sort(files.begin(), files.end());
+
+    string const &dst = outdir.empty() ? source : outdir;
+    for (auto const &rel : files)
+    {
+        Aapt9PNGJob job;
+        if (decodeMode)
+        {
+            // xxx.9.png -> xxx.json(.9pm) + xxx.png
+            if (!ends_with(rel, ".9.png"))
+            {
+                continue;
+            }
+            string stem = rel.substr(0, rel.length() - 6);
+            job.pkgpng = source + "/" + rel;
+            job.json = dst + "/" + stem + Aapt9PNGMetadataExtension(bundle);
+            job.png = dst + "/" + stem + ".png";
+        }
+        else
+        {
+            // xxx.png + xxx.json(.9pm) -> xxx.9.png
+            if (!ends_with(rel, ".png") || ends_with(rel, ".9.png"))
+            {
+                continue;
+            }
+            string stem = rel.substr(0, rel.length() - 4);
+            job.json = source + "/" + stem + ".json";
+            if (!is_file(job.json))
+            {
+                job.json = source + "/" + stem + ".9pm";
+                if (!is_file(job.json))
+                {
+                    continue;
+                }
+            }
+            job.pkgpng = dst + "/" + stem + ".9.png";
+            job.png = source + "/" + rel;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+int RunAapt9PNGJobs(vector<Aapt9PNGJob> &jobs, bool decodeMode, int threads, Bundle const *bundle)
+{
+    if (threads <= 0)
+    {
+        threads = (int)::std::thread::hardware_concurrency();
+    }
+    threads = ::std::max(1, ::std::min(threads, (int)jobs.size()));
+
+    // 工作线程已经占满 cpu, COMPRESSION_MAX 的尝试线程只分到剩余的份额
+    Bundle jobBundle;
+    if (bundle)
+    {
+        jobBundle = *bundle;
+        if (jobBundle.trialThreads <= 0)
+        {
+            int cores = ::std::max(1, (int)::std::thread::hardware_concurrency());
+            jobBundle.trialThreads = ::std::max(1, cores / threads);
+        }
+        bundle = &jobBundle;
+    }
+
+    ::std::atomic<size_t> next(0);
+    ::std::atomic<int> succeeded(0);
+
+    // 每个工作线程顺序领取任务, 任务之间不共享任何 libpng 状态
+    auto worker = [&]() {
+        size_t idx;
+        while ((idx = next.fetch_add(1)) < jobs.size())
+        {
+            Aapt9PNGJob &job = jobs[idx];
+            if (decodeMode)
+            {
+                make_dirs(job.json);
+                make_dirs(job.png);
+                job.success = DecodeAapt9PNG(job.pkgpng, job.json, job.png, bundle, &job.error);
+            }
+            else
+            {
+                make_dirs(job.pkgpng);
+                job.success = EncodeAapt9PNG(job.pkgpng, job.json, job.png, bundle, &job.error);
+            }
+            if (job.success)
+            {
+                succeeded++;
+            }
+        }
+    };
+
+    vector<::std::thread> pool;
+    for (int i = 1; i < threads; i++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : pool)
+    {
+        th.join();
+    }
+
+    return succeeded;
+}
+
+#define MANIFEST_HEADER "aapt-9png-manifest 2"
+
+struct manifest_input
+{
+    uint64_t size;
+    int64_t mtime;
+    string hash;
+};
+
+struct manifest_job
+{
+    bool decodeMode;
+    string fingerprint;
+};
+
+/**
+ * 文本格式, 字段以 tab 分隔. 路径中的反斜杠, tab, 换行与回车转义为 \\, \t, \n, \r:
+ *   input <path> <size> <mtime ns> <sha256>
+ *   job <d|c> <pkgpng> <json> <png> <fingerprint>
+ * 失败的任务保留上次的记录但指纹为空, 下次一定重新处理, 其输入被删除时仍能清理旧的输出.
+ */
+struct batch_manifest
+{
+    ::std::map<string, manifest_input> inputs;
+    ::std::map<string, manifest_job> jobs;
+};
+
+static vector<string> split_tabs(string const &line)
+{
+    vector<string> fields;
+    size_t begin = 0, end;
+    while ((end = line.find('\t', begin)) != string::npos)
+    {
+        fields.push_back(line.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    fields.push_back(line.substr(begin));
+    return fields;
+}
+
+static string escape_field(string const &field)
+{
+    string out;
+    for (char ch : field)
+    {
+        switch (ch)
+        {
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        default:
+            out += ch;
+            break;
+        }
+    }
+    return out;
+}
+
+static string unescape_field(string const &field)
+{
+    string out;
+    for (size_t i = 0; i < field.length(); i++)
+    {
+        char ch = field[i];
+        if (ch == '\\' && i + 1 < field.length())
+        {
+            ch = field[++i];
+            ch = ch == 't' ? '\t' : ch == 'n' ? '\n' : ch == 'r' ? '\r' : ch;
+        }
+        out += ch;
+    }
+    return out;
+}
+
+// 三个路径转义后以 tab 连接, 与 manifest 中 job 行的字段相同
+static string job_key(Aapt9PNGJob const &job)
+{
+    return escape_field(job.pkgpng) + "\t" + escape_field(job.json) + "\t" + escape_field(job.png);
+}
+
+static vector<string> job_inputs(Aapt9PNGJob const &job, bool decodeMode)
+{
+    return decodeMode ? vector<string>{job.pkgpng} : vector<string>{job.json, job.png};
+}
+
+static vector<string> job_outputs(Aapt9PNGJob const &job, bool decodeMode)
+{
+    return decodeMode ? vector<string>{job.json, job.png} : vector<string>{job.pkgpng};
+}
+
+// 格式不符或版本不同时视为空 manifest, 即全部重新处理
+static void load_manifest(string const &path, batch_manifest *manifest)
+{
+    ::std::ifstream stm(path);
+    string line;
+    if (!::std::getline(stm, line) || line != MANIFEST_HEADER)
+    {
+        return;
+    }
+
+    while (::std::getline(stm, line))
+    {
+        vector<string> fields = split_tabs(line);
+        if (fields[0] == "input" && fields.size() == 5)
+        {
+            manifest_input &input = manifest->inputs[unescape_field(fields[1])];
+            input.size = strtoull(fields[2].c_str(), nullptr, 10);
+            input.mtime = strtoll(fields[3].c_str(), nullptr, 10);
+            input.hash = fields[4];
+        }
+        else if (fields[0] == "job" && fields.size() == 6)
+        {
+            manifest_job &job = manifest->jobs[fields[2] + "\t" + fields[3] + "\t" + fields[4]];
+            job.decodeMode = fields[1] == "d";
+            job.fingerprint = fields[5];
+        }
+    }
+}
+
+static bool save_manifest(string const &path, batch_manifest const &manifest)
+{
+    string tmp = path + ".tmp";
+    {
+        ::std::ofstream stm(tmp);
+        stm << MANIFEST_HEADER << "\n";
+        for (auto const &input : manifest.inputs)
+        {
+            stm << "input\t" << escape_field(input.first) << "\t" << input.second.size << "\t"
+                << input.second.mtime << "\t" << input.second.hash << "\n";
+        }
+        for (auto const &job : manifest.jobs)
+        {
+            stm << "job\t" << (job.second.decodeMode ? "d" : "c") << "\t" << job.first << "\t"
+                << job.second.fingerprint << "\n";
+        }
+        stm.close();
+        if (stm.fail())
+        {
+            unlink(tmp.c_str());
+            return false;
+        }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// 大小与修改时间都未变时沿用 manifest 中的哈希, 否则重新计算
+static bool hash_input(string const &path, batch_manifest const &old, batch_manifest *now, string *hash)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return false;
+    }
+
+    manifest_input input;
+    input.size = st.st_size;
+    input.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+    auto found = old.inputs.find(path);
+    if (found != old.inputs.end() && found->second.size == input.size && found->second.mtime == input.mtime)
+    {
+        input.hash = found->second.hash;
+    }
+    else
+    {
+        MappedFile mapped;
+        if (!mapped.open(path))
+        {
+            return false;
+        }
+        Sha256 sha;
+        sha.update(mapped.data(), mapped.size());
+        input.hash = sha.hexdigest();
+    }
+
+    now->inputs[path] = input;
+    *hash = input.hash;
+    return true;
+}
+
+int RunAapt9PNGJobsIncremental(vector<Aapt9PNGJob> &jobs, bool decodeMode, int threads,
+                               Bundle const *bundle, string const &manifest)
+{
+    batch_manifest old, now;
+    load_manifest(manifest, &old);
+
+    // 任务指纹: 操作, 影响输出的设置与全部输入的哈希
+    vector<string> fingerprints(jobs.size());
+    vector<size_t> pending;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        Aapt9PNGJob &job = jobs[i];
+        vector<string> hashes;
+        for (auto const &path : job_inputs(job, decodeMode))
+        {
+            string hash;
+            if (!hash_input(path, old, &now, &hash))
+            {
+                hashes.clear();
+                break;
+            }
+            hashes.push_back(hash);
+        }
+        if (hashes.empty())
+        {
+            pending.push_back(i);
+            continue;
+        }
+
+        vector<::std::pair<uint8_t const *, size_t>> parts;
+        for (auto const &hash : hashes)
+        {
+            parts.push_back(::std::make_pair((uint8_t const *)hash.data(), hash.size()));
+        }
+        fingerprints[i] = MakeAapt9PNGCacheKey(decodeMode ? "decode" : "encode", bundle, parts);
+
+        auto found = old.jobs.find(job_key(job));
+        bool upToDate = found != old.jobs.end() && found->second.decodeMode == decodeMode &&
+                        found->second.fingerprint == fingerprints[i];
+        for (auto const &output : job_outputs(job, decodeMode))
+        {
+            upToDate = upToDate && is_file(output);
+        }
+
+        if (upToDate)
+        {
+            job.upToDate = job.success = true;
+        }
+        else
+        {
+            pending.push_back(i);
+        }
+    }
+
+    vector<Aapt9PNGJob> todo;
+    for (auto i : pending)
+    {
+        todo.push_back(jobs[i]);
+    }
+    RunAapt9PNGJobs(todo, decodeMode, threads, bundle);
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        jobs[pending[i]] = todo[i];
+    }
+
+    // 本次任务的输出与输入都不能被清理; 上次的任务可能是相反方向,
+    // 其输出正是本次的输入
+    int succeeded = 0;
+    ::std::set<string> livePaths;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        for (auto const &output : job_outputs(jobs[i], decodeMode))
+        {
+            livePaths.insert(output);
+        }
+        for (auto const &input : job_inputs(jobs[i], decodeMode))
+        {
+            livePaths.insert(input);
+        }
+        if (!jobs[i].success)
+        {
+            // 保留上次成功时的记录以便之后清理其输出, 清空指纹使下次重新处理
+            auto previous = old.jobs.find(job_key(jobs[i]));
+            if (previous != old.jobs.end())
+            {
+                manifest_job &record = now.jobs[previous->first];
+                record.decodeMode = previous->second.decodeMode;
+                record.fingerprint.clear();
+            }
+            continue;
+        }
+        succeeded++;
+        if (!fingerprints[i].empty())
+        {
+            manifest_job &record = now.jobs[job_key(jobs[i])];
+            record.decodeMode = decodeMode;
+            record.fingerprint = fingerprints[i];
+        }
+    }
+
+    // 删除本次不再存在的任务的输出
+    ::std::set<string> currentKeys;
+    for (auto const &job : jobs)
+    {
+        currentKeys.insert(job_key(job));
+    }
+    for (auto const &record : old.jobs)
+    {
+        if (currentKeys.count(record.first))
+        {
+            continue;
+        }
+        vector<string> fields = split_tabs(record.first);
+        Aapt9PNGJob removed;
+        removed.pkgpng = unescape_field(fields[0]);
+        removed.json = unescape_field(fields[1]);
+        removed.png = unescape_field(fields[2]);
+        for (auto const &output : job_outputs(removed, record.second.decodeMode))
+        {
+            if (!livePaths.count(output))
+            {
+                unlink(output.c_str());
+            }
+        }
+    }
+
+    save_manifest(manifest, now);
+    return succeeded;
+}
@@ -0,0 +1,55 @@
+#ifndef __9PNG_BATCH_H_INCLUDED
+#define __9PNG_BATCH_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include "9png-error.hpp"
+
+class Bundle;
+
+/**
+ * @brief 批处理中的单个任务, 参数顺序与 DecodeAapt9PNG/EncodeAapt9PNG 一致
+ */
+struct Aapt9PNGJob
+{
+    Aapt9PNGJob() : success(false), upToDate(false) {}
+
+    // 解压模式为输入的 .9.png, 合并模式为输出的 .9.png
+    ::std::string pkgpng;
+    ::std::string json;
+    ::std::string png;
+
+    bool success;
+    Aapt9PNGError error;
+
+    // 增量模式下输入与设置均未变化, 没有重新处理
+    bool upToDate;
+};
+
+/**
+ * @brief 收集批处理任务
+ * @param source 目录(递归扫描)或清单文件(每行 "pkgpng json png")
+ * @param outdir 输出目录, 为空时输出到输入文件旁
+ * @param bundle 决定解压输出的.9信息扩展名; 合并时 .json 与 .9pm 都会查找
+ */
+extern bool CollectAapt9PNGJobs(::std::string const &source, ::std::string const &outdir, bool decodeMode,
+                                Bundle const *bundle, ::std::vector<Aapt9PNGJob> &jobs);
+
+/**
+ * @brief 使用固定数量的工作线程执行批处理
+ * @return 成功的任务数
+ */
+extern int RunAapt9PNGJobs(::std::vector<Aapt9PNGJob> &jobs, bool decodeMode, int threads, Bundle const *bundle);
+
+/**
+ * @brief 增量批处理, 只处理输入内容或设置变化过的任务
+ *
+ * manifest 记录每个输入的大小, 修改时间与 SHA-256, 以及每个任务的指纹.
+ * 大小和修改时间都未变时不重新计算哈希. 上次存在而本次不存在的任务, 其输出会被删除.
+ * 失败的任务不写入 manifest, 下次运行时重试.
+ * @return 成功(包括无需处理)的任务数
+ */
+extern int RunAapt9PNGJobsIncremental(::std::vector<Aapt9PNGJob> &jobs, bool decodeMode, int threads,
+                                      Bundle const *bundle, ::std::string const &manifest);
+
+#endif
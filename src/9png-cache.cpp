@@ -0,0 +1,346 @@
+#include "9png-cache.hpp"
+#include "android-bundle.hpp"
+#include "sha256.hpp"
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using ::std::string;
+using ::std::vector;
+
+// 本进程的命中统计, 由 FlushAapt9PNGCacheStats 写入缓存目录
+static ::std::atomic<uint64_t> s_hits(0);
+static ::std::atomic<uint64_t> s_misses(0);
+
+// 临时文件名的序号, 与 pid 一起保证多线程/多进程不冲突
+static ::std::atomic<unsigned> s_tmpSerial(0);
+
+static void hash_int(Sha256 &sha, int64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++)
+    {
+        bytes[i] = (uint8_t)(value >> (i * 8));
+    }
+    sha.update(bytes, sizeof(bytes));
+}
+
+string MakeAapt9PNGCacheKey(char const *op, Bundle const *bundle,
+                            vector<::std::pair<uint8_t const *, size_t>> const &inputs)
+{
+    Bundle defaults;
+    if (!bundle)
+    {
+        bundle = &defaults;
+    }
+
+    Sha256 sha;
+    hash_int(sha, AAPT9PNG_CACHE_VERSION);
+    sha.update(op, strlen(op) + 1);
+    hash_int(sha, bundle->minSdk);
+    hash_int(sha, bundle->grayscaleTolerance);
+    hash_int(sha, bundle->compressionProfile);
+    hash_int(sha, bundle->prettyJson);
+    hash_int(sha, bundle->metadataFormat);
+
+    // 每个输入前写入长度, 避免不同的切分得到相同的字节流
+    hash_int(sha, inputs.size());
+    for (auto const &input : inputs)
+    {
+        hash_int(sha, input.second);
+        sha.update(input.first, input.second);
+    }
+    return sha.hexdigest();
+}
+
+// 条目按键的前两位分散到子目录, 第 index 个输出存为 <key>.<index>
+static string entry_path(string const &dir, string const &key, size_t index)
+{
+    return dir + "/" + key.substr(0, 2) + "/" + key + "." + ::std::to_string(index);
+}
+
+static string tmp_path(string const &path)
+{
+    return path + ".tmp" + ::std::to_string(getpid()) + "-" + ::std::to_string(s_tmpSerial++);
+}
+
+static bool is_tmp_name(string const &name)
+{
+    return name.find(".tmp") != string::npos;
+}
+
+static bool copy_file(string const &from, string const &to)
+{
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0)
+    {
+        return false;
+    }
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+
+    bool suc = true;
+    char buf[64 * 1024];
+    ssize_t n;
+    while (suc && (n = read(in, buf, sizeof(buf))) != 0)
+    {
+        suc = n > 0 && write(out, buf, n) == n;
+    }
+    close(in);
+    return close(out) == 0 && suc;
+}
+
+// 先放到临时文件再改名, 读者看到的要么是旧文件要么是完整的新文件
+static bool place_file(string const &from, string const &to, bool allowLink)
+{
+    string tmp = tmp_path(to);
+    if (!(allowLink && link(from.c_str(), tmp.c_str()) == 0) && !copy_file(from, tmp))
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    if (rename(tmp.c_str(), to.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool FetchAapt9PNGCache(string const &dir, string const &key, vector<string> const &outputs)
+{
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        if (access(entry_path(dir, key, i).c_str(), R_OK) != 0)
+        {
+            s_misses++;
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        // 修改时间即最近使用时间. 在链接之前刷新, 放置好的输出就像刚写出的文件一样,
+        // 之后不再修改这个与输出共享的 inode
+        string entry = entry_path(dir, key, i);
+        utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+        if (!place_file(entry, outputs[i], true))
+        {
+            s_misses++;
+            return false;
+        }
+    }
+    s_hits++;
+    return true;
+}
+
+void StoreAapt9PNGCache(string const &dir, string const &key, vector<string> const &outputs)
+{
+    mkdir(dir.c_str(), 0755);
+    mkdir((dir + "/" + key.substr(0, 2)).c_str(), 0755);
+
+    // 存入时复制, 之后对输出文件的原地修改不会影响缓存
+    for (size_t i = 0; i < outputs.size(); i++)
+    {
+        place_file(outputs[i], entry_path(dir, key, i), false);
+    }
+}
+
+// 一个键的全部输出文件作为整体淘汰, 避免留下不完整的条目
+struct cache_entry
+{
+    vector<string> paths;
+    struct timespec mtime;
+    uint64_t size;
+};
+
+static bool newer(struct timespec const &a, struct timespec const &b)
+{
+    return a.tv_sec != b.tv_sec ? a.tv_sec > b.tv_sec : a.tv_nsec > b.tv_nsec;
+}
+
+static void list_entries(string const &dir, vector<cache_entry> &entries)
+{
+    DIR *root = opendir(dir.c_str());
+    if (!root)
+    {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(root)) != NULL)
+    {
+        string name = ent->d_name;
+        if (name.length() != 2 || name == "..")
+        {
+            continue;
+        }
+
+        string subdir = dir + "/" + name;
+        DIR *sub = opendir(subdir.c_str());
+        if (!sub)
+        {
+            continue;
+        }
+        ::std::map<string, cache_entry> keys;
+        struct dirent *file;
+        while ((file = readdir(sub)) != NULL)
+        {
+            string fname = file->d_name;
+            string path = subdir + "/" + fname;
+            size_t dot = fname.rfind('.');
+            struct stat st;
+            if (fname[0] == '.' || dot == string::npos || is_tmp_name(fname) ||
+                stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            {
+                continue;
+            }
+
+            auto found = keys.find(fname.substr(0, dot));
+            if (found == keys.end())
+            {
+                cache_entry entry;
+                entry.paths.push_back(path);
+                entry.mtime = st.st_mtim;
+                entry.size = st.st_size;
+                keys[fname.substr(0, dot)] = entry;
+                continue;
+            }
+            cache_entry &entry = found->second;
+            entry.paths.push_back(path);
+            entry.size += st.st_size;
+            if (newer(st.st_mtim, entry.mtime))
+            {
+                entry.mtime = st.st_mtim;
+            }
+        }
+        closedir(sub);
+
+        for (auto &key : keys)
+        {
+            entries.push_back(key.second);
+        }
+    }
+    closedir(root);
+}
+
+void TrimAapt9PNGCache(string const &dir, uint64_t maxBytes)
+{
+    vector<cache_entry> entries;
+    list_entries(dir, entries);
+
+    uint64_t total = 0;
+    for (auto const &entry : entries)
+    {
+        total += entry.size;
+    }
+    if (total <= maxBytes)
+    {
+        return;
+    }
+
+    // 最久未使用的在前
+    ::std::sort(entries.begin(), entries.end(), [](cache_entry const &a, cache_entry const &b) {
+        return newer(b.mtime, a.mtime);
+    });
+
+    for (auto const &entry : entries)
+    {
+        if (total <= maxBytes)
+        {
+            break;
+        }
+        for (auto const &path : entry.paths)
+        {
+            unlink(path.c_str());
+        }
+        total -= entry.size;
+    }
+}
+
+static bool read_counters(int fd, uint64_t *hits, uint64_t *misses)
+{
+    char buf[128] = {0};
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    unsigned long long h = 0, m = 0;
+    if (n > 0 && sscanf(buf, "hits %llu\nmisses %llu", &h, &m) != 2)
+    {
+        return false;
+    }
+    *hits = h;
+    *misses = m;
+    return true;
+}
+
+void FlushAapt9PNGCacheStats(string const &dir)
+{
+    uint64_t hits = s_hits.exchange(0);
+    uint64_t misses = s_misses.exchange(0);
+    if (!hits && !misses)
+    {
+        return;
+    }
+
+    mkdir(dir.c_str(), 0755);
+    int fd = open((dir + "/stats").c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    // 多个进程共用一个缓存目录, 读-改-写期间加锁
+    flock(fd, LOCK_EX);
+    uint64_t totalHits, totalMisses;
+    if (read_counters(fd, &totalHits, &totalMisses))
+    {
+        char buf[128];
+        int n = snprintf(buf, sizeof(buf), "hits %llu\nmisses %llu\n",
+                         (unsigned long long)(totalHits + hits), (unsigned long long)(totalMisses + misses));
+        if (ftruncate(fd, 0) == 0)
+        {
+            pwrite(fd, buf, n, 0);
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+bool GetAapt9PNGCacheStats(string const &dir, Aapt9PNGCacheStats *stats)
+{
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        return false;
+    }
+
+    vector<cache_entry> entries;
+    list_entries(dir, entries);
+    stats->entries = entries.size();
+    stats->bytes = 0;
+    for (auto const &entry : entries)
+    {
+        stats->bytes += entry.size;
+    }
+
+    stats->hits = stats->misses = 0;
+    int fd = open((dir + "/stats").c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        flock(fd, LOCK_SH);
+        read_counters(fd, &stats->hits, &stats->misses);
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+    return true;
+}
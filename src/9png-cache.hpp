@@ -0,0 +1,62 @@
+#ifndef __9PNG_CACHE_H_INCLUDED
+#define __9PNG_CACHE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+class Bundle;
+
+/**
+ * @brief 输出格式变化时递增, 旧版本的缓存条目自然失效
+ */
+#define AAPT9PNG_CACHE_VERSION 2
+
+/**
+ * @brief 缓存目录的统计信息, hits/misses 为所有已结束进程的累计值
+ */
+struct Aapt9PNGCacheStats
+{
+    Aapt9PNGCacheStats() : entries(0), bytes(0), hits(0), misses(0) {}
+
+    uint64_t entries;
+    uint64_t bytes;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/**
+ * @brief 计算缓存键: 操作类型, 影响输出的 Bundle 字段与全部输入内容的 SHA-256
+ */
+extern ::std::string MakeAapt9PNGCacheKey(char const *op, Bundle const *bundle,
+                                          ::std::vector<::std::pair<uint8_t const *, size_t>> const &inputs);
+
+/**
+ * @brief 命中时将缓存的结果硬链接(失败则复制)到 outputs, 所有输出都在缓存中才算命中
+ *
+ * 条目的修改时间作为最近使用时间, 在链接之前刷新, 因此输出的修改时间是本次放置的时间,
+ * 链接之后不会再被改动. 先前链接到同一条目的其它输出共享 inode, 修改时间会随之变新.
+ */
+extern bool FetchAapt9PNGCache(::std::string const &dir, ::std::string const &key,
+                               ::std::vector<::std::string> const &outputs);
+
+/**
+ * @brief 将已生成的 outputs 存入缓存, 先写临时文件再改名, 多线程/多进程写同一键是安全的
+ */
+extern void StoreAapt9PNGCache(::std::string const &dir, ::std::string const &key,
+                               ::std::vector<::std::string> const &outputs);
+
+/**
+ * @brief 按最近使用时间淘汰条目, 直至总大小不超过 maxBytes
+ */
+extern void TrimAapt9PNGCache(::std::string const &dir, uint64_t maxBytes);
+
+/**
+ * @brief 将本进程的命中统计累加到缓存目录中的统计文件
+ */
+extern void FlushAapt9PNGCacheStats(::std::string const &dir);
+
+extern bool GetAapt9PNGCacheStats(::std::string const &dir, Aapt9PNGCacheStats *stats);
+
+#endif
@@ -0,0 +1,22 @@
+#include "9png-error.hpp"
+
+void SetAapt9PNGError(Aapt9PNGError *error, int code, ::std::string const &message,
+                      char const *edge, int pixel)
+{
+    if (!error || error->code != AAPT9PNG_OK)
+    {
+        return;
+    }
+    error->code = code;
+    error->message = message;
+    error->edge = edge ? edge : "";
+    error->pixel = pixel;
+}
+
+void AddAapt9PNGWarning(Aapt9PNGError *error, ::std::string const &message)
+{
+    if (error)
+    {
+        error->warnings.push_back(message);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef __9PNG_ERROR_H_INCLUDED
+#define __9PNG_ERROR_H_INCLUDED
+
+#include <string>
+#include <vector>
+
+typedef enum
+{
+    AAPT9PNG_OK,
+    AAPT9PNG_ERROR_IO,        // 无法读写文件
+    AAPT9PNG_ERROR_PNG,       // libpng 报告的错误, 或不是png
+    AAPT9PNG_ERROR_METADATA,  // .9信息格式有误或与图片不符
+    AAPT9PNG_ERROR_MALFORMED, // 原始.9.png的边框不合法
+    AAPT9PNG_ERROR_NO_MEMORY
+} AAPT9PNG_ERROR_CODE;
+
+/**
+ * @brief 单次调用的错误与警告, 由调用方提供, 不在线程间共享
+ */
+struct Aapt9PNGError
+{
+    Aapt9PNGError() : code(AAPT9PNG_OK), pixel(-1) {}
+
+    int code;
+    ::std::string message;
+
+    // 原始.9.png出错的边框(top/left/bottom/right)与沿该边的像素序号, 未知时为空/-1
+    ::std::string edge;
+    int pixel;
+
+    // libpng 等报告的警告, 不影响结果
+    ::std::vector<::std::string> warnings;
+};
+
+/**
+ * @brief 记录错误, error 为空时忽略; 只保留第一个错误, 后续更笼统的错误不会覆盖根因
+ */
+extern void SetAapt9PNGError(Aapt9PNGError *error, int code, ::std::string const &message,
+                             char const *edge = nullptr, int pixel = -1);
+
+extern void AddAapt9PNGWarning(Aapt9PNGError *error, ::std::string const &message);
+
+#endif
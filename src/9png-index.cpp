@@ -0,0 +1,215 @@
+#include "9png-index.hpp"
+#include "android-images.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+using ::std::string;
+using ::std::vector;
+
+#define INDEX_MAGIC "A9PI"
+
+struct index_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t recordSize;
+    uint32_t recordsOffset;
+    uint32_t valuesOffset;
+    uint32_t valuesCount;
+    uint32_t namesOffset;
+    uint32_t namesSize;
+};
+
+bool Aapt9PNGIndex::open(string const &path)
+{
+    count_ = 0;
+    if (!file_.open(path) || file_.size() < sizeof(index_header))
+    {
+        return false;
+    }
+
+    index_header header;
+    memcpy(&header, file_.data(), sizeof(header));
+    uint64_t size = file_.size();
+    if (memcmp(header.magic, INDEX_MAGIC, 4) != 0 || header.version != AAPT9PNG_INDEX_VERSION ||
+        header.recordSize != sizeof(Aapt9PNGIndexRecord) ||
+        header.recordsOffset % 4 != 0 || header.valuesOffset % 4 != 0 ||
+        header.recordsOffset + (uint64_t)header.count * sizeof(Aapt9PNGIndexRecord) > size ||
+        header.valuesOffset + (uint64_t)header.valuesCount * sizeof(int32_t) > size ||
+        header.namesOffset + (uint64_t)header.namesSize > size)
+    {
+        return false;
+    }
+
+    records_ = (Aapt9PNGIndexRecord const *)(file_.data() + header.recordsOffset);
+    values_ = (int32_t const *)(file_.data() + header.valuesOffset);
+    names_ = (char const *)(file_.data() + header.namesOffset);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        Aapt9PNGIndexRecord const &record = records_[i];
+        uint64_t values = (uint64_t)record.numXDivs + record.numYDivs + record.numColors;
+        if ((uint64_t)record.nameOffset + record.nameLength > header.namesSize ||
+            record.valuesOffset + values > header.valuesCount)
+        {
+            return false;
+        }
+    }
+    count_ = header.count;
+    return true;
+}
+
+// 名称按字节比较, 与写入时的排序一致
+static int compare_name(char const *a, size_t aLength, char const *b, size_t bLength)
+{
+    int cmp = memcmp(a, b, ::std::min(aLength, bLength));
+    if (cmp != 0)
+    {
+        return cmp;
+    }
+    return aLength < bLength ? -1 : (aLength > bLength ? 1 : 0);
+}
+
+Aapt9PNGIndexRecord const *Aapt9PNGIndex::find(string const &name) const
+{
+    size_t lo = 0, hi = count_;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        Aapt9PNGIndexRecord const &record = records_[mid];
+        int cmp = compare_name(names_ + record.nameOffset, record.nameLength, name.data(), name.length());
+        if (cmp == 0)
+        {
+            return &record;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return nullptr;
+}
+
+string Aapt9PNGIndex::name(Aapt9PNGIndexRecord const &record) const
+{
+    return string(names_ + record.nameOffset, record.nameLength);
+}
+
+int32_t const *Aapt9PNGIndex::xDivs(Aapt9PNGIndexRecord const &record) const
+{
+    return values_ + record.valuesOffset;
+}
+
+int32_t const *Aapt9PNGIndex::yDivs(Aapt9PNGIndexRecord const &record) const
+{
+    return values_ + record.valuesOffset + record.numXDivs;
+}
+
+uint32_t const *Aapt9PNGIndex::colors(Aapt9PNGIndexRecord const &record) const
+{
+    return (uint32_t const *)(values_ + record.valuesOffset + record.numXDivs + record.numYDivs);
+}
+
+static void fill_record(image_info const &info, Aapt9PNGIndexRecord *record, vector<int32_t> &values)
+{
+    memset(record, 0, sizeof(*record));
+    record->width = info.width;
+    record->height = info.height;
+    record->valuesOffset = values.size();
+    if (info.is9Patch)
+    {
+        Res_png_9patch const &patch = info.info9Patch;
+        record->flags |= Aapt9PNGIndexRecord::NINE_PATCH;
+        record->numXDivs = patch.numXDivs;
+        record->numYDivs = patch.numYDivs;
+        record->numColors = patch.numColors;
+        record->padding[0] = patch.paddingLeft;
+        record->padding[1] = patch.paddingTop;
+        record->padding[2] = patch.paddingRight;
+        record->padding[3] = patch.paddingBottom;
+        values.insert(values.end(), info.xDivs, info.xDivs + patch.numXDivs);
+        values.insert(values.end(), info.yDivs, info.yDivs + patch.numYDivs);
+        values.insert(values.end(), info.colors, info.colors + patch.numColors);
+    }
+    if (info.haveLayoutBounds)
+    {
+        record->flags |= Aapt9PNGIndexRecord::LAYOUT_BOUNDS;
+        memcpy(record->layoutBounds, &info.layoutBoundsLeft, sizeof(record->layoutBounds));
+    }
+    memcpy(record->outlineInsets, &info.outlineInsetsLeft, sizeof(record->outlineInsets));
+    record->outlineRadius = info.outlineRadius;
+    record->outlineAlpha = info.outlineAlpha;
+}
+
+bool WriteAapt9PNGIndex(string const &output, vector<::std::pair<string, string>> const &inputs,
+                        vector<string> *failed)
+{
+    vector<::std::pair<string, string>> sorted(inputs);
+    ::std::stable_sort(sorted.begin(), sorted.end(),
+                       [](::std::pair<string, string> const &a, ::std::pair<string, string> const &b) {
+                           return a.first < b.first;
+                       });
+
+    vector<Aapt9PNGIndexRecord> records;
+    vector<int32_t> values;
+    string names;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        if (i > 0 && sorted[i].first == sorted[i - 1].first)
+        {
+            continue;
+        }
+
+        // 只读到第一个 IDAT 为止
+        MappedFile mapped;
+        image_info info;
+        if (!mapped.open(sorted[i].second) || !read_9patch_chunks_only(mapped.data(), mapped.size(), &info))
+        {
+            if (failed)
+            {
+                failed->push_back(sorted[i].second);
+            }
+            continue;
+        }
+
+        Aapt9PNGIndexRecord record;
+        fill_record(info, &record, values);
+        record.nameOffset = names.size();
+        record.nameLength = sorted[i].first.length();
+        names += sorted[i].first;
+        records.push_back(record);
+    }
+
+    index_header header;
+    memcpy(header.magic, INDEX_MAGIC, 4);
+    header.version = AAPT9PNG_INDEX_VERSION;
+    header.count = records.size();
+    header.recordSize = sizeof(Aapt9PNGIndexRecord);
+    header.recordsOffset = sizeof(header);
+    header.valuesOffset = header.recordsOffset + records.size() * sizeof(Aapt9PNGIndexRecord);
+    header.valuesCount = values.size();
+    header.namesOffset = header.valuesOffset + values.size() * sizeof(int32_t);
+    header.namesSize = names.size();
+
+    // 写入临时文件再改名, 读者不会映射到写了一半的索引
+    string tmp = output + ".tmp";
+    ::std::ofstream stm(tmp, ::std::ios::binary);
+    stm.write((char const *)&header, sizeof(header));
+    stm.write((char const *)records.data(), records.size() * sizeof(Aapt9PNGIndexRecord));
+    stm.write((char const *)values.data(), values.size() * sizeof(int32_t));
+    stm.write(names.data(), names.size());
+    stm.close();
+    if (stm.fail() || rename(tmp.c_str(), output.c_str()) != 0)
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,82 @@
+#ifndef __9PNG_INDEX_H_INCLUDED
+#define __9PNG_INDEX_H_INCLUDED
+
+#include "mapped-file.hpp"
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#define AAPT9PNG_INDEX_VERSION 1
+
+/**
+ * @brief 索引文件中的定长记录, 按名称的字节序排列
+ *
+ * 文件布局(主机字节序): 文件头, 记录表, 数值区(int32: 每条记录的 xDivs, yDivs, colors 依次排列), 名称区
+ */
+struct Aapt9PNGIndexRecord
+{
+    enum
+    {
+        NINE_PATCH = 1,
+        LAYOUT_BOUNDS = 2
+    };
+
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t width;
+    uint32_t height;
+
+    uint8_t flags;
+    uint8_t numXDivs;
+    uint8_t numYDivs;
+    uint8_t numColors;
+    uint32_t valuesOffset; // 在数值区中的下标
+
+    int32_t padding[4];       // left, top, right, bottom
+    int32_t layoutBounds[4];  // left, top, right, bottom
+    int32_t outlineInsets[4]; // left, top, right, bottom
+    float outlineRadius;
+    uint32_t outlineAlpha;
+};
+
+/**
+ * @brief 只读映射索引文件, 按名称二分查找
+ */
+class Aapt9PNGIndex
+{
+public:
+    Aapt9PNGIndex() : records_(nullptr), values_(nullptr), names_(nullptr), count_(0) {}
+
+    // 打开时校验所有记录的偏移, 之后的访问不再检查
+    bool open(::std::string const &path);
+
+    size_t size() const { return count_; }
+    Aapt9PNGIndexRecord const &at(size_t i) const { return records_[i]; }
+
+    Aapt9PNGIndexRecord const *find(::std::string const &name) const;
+
+    ::std::string name(Aapt9PNGIndexRecord const &record) const;
+    int32_t const *xDivs(Aapt9PNGIndexRecord const &record) const;
+    int32_t const *yDivs(Aapt9PNGIndexRecord const &record) const;
+    uint32_t const *colors(Aapt9PNGIndexRecord const &record) const;
+
+private:
+    MappedFile file_;
+    Aapt9PNGIndexRecord const *records_;
+    int32_t const *values_;
+    char const *names_;
+    size_t count_;
+};
+
+/**
+ * @brief 读取每个 .9.png 的 npTc/npOl/npLb chunk (不解码像素), 写入一个索引文件
+ * @param inputs (名称, .9.png 路径), 名称重复时只保留第一个
+ * @param failed 无法读取的输入路径
+ */
+extern bool WriteAapt9PNGIndex(::std::string const &output,
+                               ::std::vector<::std::pair<::std::string, ::std::string>> const &inputs,
+                               ::std::vector<::std::string> *failed);
+
+#endif
@@ -0,0 +1,81 @@
+#include "9png-log.hpp"
+#include <stdarg.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+
+#define LOG_BUFFER_SIZE 4096
+
+static ::std::atomic<int> log_level(AAPT9PNG_LOG_WARN);
+
+struct log_buffer
+{
+    log_buffer() : length(0) {}
+
+    // 线程退出时输出残留的半行
+    ~log_buffer()
+    {
+        flush();
+    }
+
+    void flush()
+    {
+        size_t done = 0;
+        while (done < length)
+        {
+            ssize_t n = ::write(STDERR_FILENO, data + done, length - done);
+            if (n <= 0)
+            {
+                break;
+            }
+            done += n;
+        }
+        length = 0;
+    }
+
+    char data[LOG_BUFFER_SIZE];
+    size_t length;
+};
+
+static thread_local log_buffer buffer;
+
+void SetAapt9PNGLogLevel(int level)
+{
+    log_level.store(level, ::std::memory_order_relaxed);
+}
+
+int GetAapt9PNGLogLevel()
+{
+    return log_level.load(::std::memory_order_relaxed);
+}
+
+void Aapt9PNGLog(int level, const char *format, ...)
+{
+    if (level > GetAapt9PNGLogLevel())
+    {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    size_t room = LOG_BUFFER_SIZE - buffer.length;
+    int n = vsnprintf(buffer.data + buffer.length, room, format, args);
+    va_end(args);
+    if (n < 0)
+    {
+        return;
+    }
+    if ((size_t)n >= room)
+    {
+        // 放不下时截断, 并保证以换行结尾
+        buffer.length = LOG_BUFFER_SIZE;
+        buffer.data[LOG_BUFFER_SIZE - 1] = '\n';
+        buffer.flush();
+        return;
+    }
+    buffer.length += n;
+    if (buffer.data[buffer.length - 1] == '\n')
+    {
+        buffer.flush();
+    }
+}
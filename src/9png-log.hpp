@@ -0,0 +1,51 @@
+#ifndef __9PNG_LOG_H_INCLUDED
+#define __9PNG_LOG_H_INCLUDED
+
+typedef enum
+{
+    AAPT9PNG_LOG_OFF = -1, // 不输出任何日志
+    AAPT9PNG_LOG_ERROR,
+    AAPT9PNG_LOG_WARN,
+    AAPT9PNG_LOG_INFO,
+    AAPT9PNG_LOG_DEBUG,  // 每张图片的分析与编码过程
+    AAPT9PNG_LOG_VERBOSE // 每个色块, 每次压缩尝试, 以及逐行像素
+} AAPT9PNG_LOG_LEVEL;
+
+// 编译期允许的最高级别, 发布版本中 DEBUG/VERBOSE 的日志连同参数求值一起被去掉
+#ifndef AAPT9PNG_LOG_MAX_LEVEL
+#ifdef DEBUG
+#define AAPT9PNG_LOG_MAX_LEVEL AAPT9PNG_LOG_VERBOSE
+#else
+#define AAPT9PNG_LOG_MAX_LEVEL AAPT9PNG_LOG_INFO
+#endif
+#endif
+
+/**
+ * @brief 设置运行时日志级别, 默认为 AAPT9PNG_LOG_WARN; 可在任意线程调用
+ *
+ * 嵌入库且不希望写 stderr 时设为 AAPT9PNG_LOG_OFF, 警告仍会记录在 Aapt9PNGError 中.
+ */
+extern void SetAapt9PNGLogLevel(int level);
+extern int GetAapt9PNGLogLevel();
+
+/**
+ * @brief 写一条日志到 stderr
+ *
+ * 内容先格式化到本线程的缓冲区, 遇到换行时以一次 write 输出整行, 不加锁.
+ * 不以换行结尾的内容会留在缓冲区中, 与下一次调用拼成同一行.
+ */
+extern void Aapt9PNGLog(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define AAPT9PNG_LOG_ENABLED(level) \
+    ((level) <= AAPT9PNG_LOG_MAX_LEVEL && (level) <= GetAapt9PNGLogLevel())
+
+#define AAPT9PNG_LOG(level, ...)                 \
+    do                                           \
+    {                                            \
+        if (AAPT9PNG_LOG_ENABLED(level))         \
+        {                                        \
+            Aapt9PNGLog((level), __VA_ARGS__);   \
+        }                                        \
+    } while (0)
+
+#endif
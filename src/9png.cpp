@@ -1,42 +1,756 @@
 #include "9png.hpp"
 #include "android-images.hpp"
+#include "mapped-file.hpp"
+#include "9png-cache.hpp"
+#include "android-bundle.hpp"
+#include "json-writer.hpp"
+#include "9png-index.hpp"
 #include <json/json.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <fstream>
+#include <memory>
 
-bool DecodeAapt9PNG(::std::string const &input, ::std::string const &outjson, ::std::string const &outpng)
+// 输出可能是缓存条目的硬链接, 写入前先删除, 不能原地覆盖.
+// 只删除有多个链接的普通文件, 设备文件与符号链接照常写入
+static void remove_output(::std::string const &path)
 {
-    auto read_file = png_create_read_struct(PNG_LIBPNG_VER_STRING, 0, nullptr, nullptr);
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+    {
+        unlink(path.c_str());
+    }
+}
+
+static bool save_file(::std::string const &path, ::std::vector<uint8_t> const &data, Aapt9PNGError *error)
+{
+    remove_output(path);
+    ::std::ofstream stm(path, ::std::ios::binary);
+    stm.write((char const *)data.data(), data.size());
+    stm.close();
+    if (stm.fail())
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_IO, "无法写入 " + path);
+        return false;
+    }
+    return true;
+}
+
+static bool open_input(MappedFile &file, ::std::string const &path, Aapt9PNGError *error)
+{
+    if (!file.open(path))
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_IO, "无法读取 " + path);
+        return false;
+    }
+    return true;
+}
+
+static void write_int_array(JsonWriter &json, char const *name, int32_t const *values, int count)
+{
+    json.key(name);
+    json.beginArray();
+    for (int i = 0; i < count; i++)
+    {
+        json.value((int64_t)values[i]);
+    }
+    json.endArray();
+}
+
+static void write_insets(JsonWriter &json, int32_t left, int32_t top, int32_t right, int32_t bottom)
+{
+    json.key("left");
+    json.value((int64_t)left);
+    json.key("top");
+    json.value((int64_t)top);
+    json.key("right");
+    json.value((int64_t)right);
+    json.key("bottom");
+    json.value((int64_t)bottom);
+}
+
+// .9信息, 字段与 parse_metadata_json 一一对应
+static void metadata_json(image_info const &info, Bundle const *bundle, ::std::vector<uint8_t> &out)
+{
+    out.clear();
+    JsonWriter json(out, bundle && bundle->prettyJson);
+    json.beginObject();
+
+    write_int_array(json, "xDivs", info.xDivs, info.is9Patch ? info.info9Patch.numXDivs : 0);
+    write_int_array(json, "yDivs", info.yDivs, info.is9Patch ? info.info9Patch.numYDivs : 0);
+
+    // 颜色是无符号的 argb, 或 NO_COLOR/TRANSPARENT_COLOR
+    json.key("colors");
+    json.beginArray();
+    for (int i = 0; info.is9Patch && i < info.info9Patch.numColors; i++)
+    {
+        json.value((int64_t)info.colors[i]);
+    }
+    json.endArray();
+
+    json.key("padding");
+    json.beginObject();
+    if (info.is9Patch)
+    {
+        write_insets(json, info.info9Patch.paddingLeft, info.info9Patch.paddingTop,
+                    info.info9Patch.paddingRight, info.info9Patch.paddingBottom);
+    }
+    else
+    {
+        write_insets(json, 0, 0, 0, 0);
+    }
+    json.endObject();
+
+    if (info.haveLayoutBounds)
+    {
+        json.key("layoutBounds");
+        json.beginObject();
+        write_insets(json, info.layoutBoundsLeft, info.layoutBoundsTop,
+                    info.layoutBoundsRight, info.layoutBoundsBottom);
+        json.endObject();
+    }
+
+    json.key("outline");
+    json.beginObject();
+    write_insets(json, info.outlineInsetsLeft, info.outlineInsetsTop,
+                info.outlineInsetsRight, info.outlineInsetsBottom);
+    json.key("radius");
+    json.value(info.outlineRadius);
+    json.key("alpha");
+    json.value((int64_t)info.outlineAlpha);
+    json.endObject();
+
+    json.endObject();
+}
+
+static bool json_int_array(Json::Value const &value, int32_t **out, uint8_t *count)
+{
+    if (!value.isArray() || value.size() > 0xff)
+    {
+        return false;
+    }
+    *count = (uint8_t)value.size();
+    *out = (int32_t *)malloc(value.size() * sizeof(int32_t));
+    for (Json::ArrayIndex i = 0; i < value.size(); i++)
+    {
+        // 颜色是 uint32, 超出 int64 的整数 asInt64 会抛出异常
+        if (!value[i].isInt64())
+        {
+            return false;
+        }
+        (*out)[i] = (int32_t)value[i].asInt64();
+    }
+    return true;
+}
+
+// 可选的整数字段, 缺省为 0. 类型或范围不对时返回 false, 不能调用会抛出异常的 asInt
+static bool json_int_field(Json::Value const &object, char const *key, int32_t *out)
+{
+    Json::Value const &value = object[key];
+    if (value.isNull())
+    {
+        *out = 0;
+        return true;
+    }
+    if (!value.isInt())
+    {
+        return false;
+    }
+    *out = value.asInt();
+    return true;
+}
+
+// 依次读取 object 中的 left/top/right/bottom; object 缺省时全部为 0
+static bool json_edges(Json::Value const &object, int32_t *left, int32_t *top, int32_t *right, int32_t *bottom)
+{
+    return (object.isNull() || object.isObject()) &&
+           json_int_field(object, "left", left) &&
+           json_int_field(object, "top", top) &&
+           json_int_field(object, "right", right) &&
+           json_int_field(object, "bottom", bottom);
+}
+
+static bool parse_metadata_json_value(Json::Value const &root, image_info *info)
+{
+    if (!root.isObject())
+    {
+        return false;
+    }
+
+    // 9patch 必须的分割与颜色
+    uint8_t numColors;
+    if (!json_int_array(root["xDivs"], &info->xDivs, &info->info9Patch.numXDivs) ||
+        !json_int_array(root["yDivs"], &info->yDivs, &info->info9Patch.numYDivs) ||
+        !json_int_array(root["colors"], (int32_t **)&info->colors, &numColors))
+    {
+        return false;
+    }
+    info->info9Patch.numColors = numColors;
+    info->is9Patch = true;
+
+    Res_png_9patch &patch = info->info9Patch;
+    if (!json_edges(root["padding"], &patch.paddingLeft, &patch.paddingTop,
+                    &patch.paddingRight, &patch.paddingBottom))
+    {
+        return false;
+    }
+
+    Json::Value const &bounds = root["layoutBounds"];
+    info->haveLayoutBounds = bounds.isObject();
+    if (!json_edges(bounds, &info->layoutBoundsLeft, &info->layoutBoundsTop,
+                    &info->layoutBoundsRight, &info->layoutBoundsBottom))
+    {
+        return false;
+    }
+
+    Json::Value const &outline = root["outline"];
+    if (!json_edges(outline, &info->outlineInsetsLeft, &info->outlineInsetsTop,
+                    &info->outlineInsetsRight, &info->outlineInsetsBottom))
+    {
+        return false;
+    }
+    Json::Value const &radius = outline["radius"];
+    Json::Value const &alpha = outline["alpha"];
+    if (!(radius.isNull() || radius.isNumeric()) ||
+        !(alpha.isNull() || (alpha.isUInt() && alpha.asUInt() <= 0xff)))
+    {
+        return false;
+    }
+    info->outlineRadius = radius.isNull() ? 0.0f : radius.asFloat();
+    info->outlineAlpha = alpha.isNull() ? 0 : (uint8_t)alpha.asUInt();
+    return true;
+}
+
+static bool parse_metadata_json(uint8_t const *data, size_t size, image_info *info)
+{
+    // 字段类型都已事先检查; jsoncpp 仍可能在嵌套过深等情况下抛出异常, 不能让它离开库
+    try
+    {
+        Json::Value root;
+        Json::CharReaderBuilder builder;
+        ::std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+        return reader->parse((char const *)data, (char const *)data + size, &root, nullptr) &&
+               parse_metadata_json_value(root, info);
+    }
+    catch (Json::Exception const &)
+    {
+        return false;
+    }
+}
+
+/**
+ * 二进制.9信息, 与 aapt 写入的 npOl/npLb 一样使用主机(小端)字节序:
+ *   metadata_binary_header
+ *   Res_png_9patch::serialize 的结果, 不做 deviceToFile, 长度为 patchSize
+ */
+#define METADATA_BINARY_MAGIC "A9PM"
+#define METADATA_BINARY_VERSION 1
+
+enum
+{
+    METADATA_BINARY_LAYOUT_BOUNDS = 1
+};
+
+struct metadata_binary_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t patchSize;
+    int32_t layoutBounds[4];
+    int32_t outlineInsets[4];
+    float outlineRadius;
+    uint32_t outlineAlpha;
+};
+
+static void metadata_binary(image_info const &info, ::std::vector<uint8_t> &out)
+{
+    Res_png_9patch patch;
+    if (info.is9Patch)
+    {
+        patch = info.info9Patch;
+        patch.wasDeserialized = false;
+    }
+    else
+    {
+        patch.numXDivs = patch.numYDivs = patch.numColors = 0;
+        patch.paddingLeft = patch.paddingTop = patch.paddingRight = patch.paddingBottom = 0;
+    }
+
+    metadata_binary_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, METADATA_BINARY_MAGIC, sizeof(header.magic));
+    header.version = METADATA_BINARY_VERSION;
+    header.flags = info.haveLayoutBounds ? METADATA_BINARY_LAYOUT_BOUNDS : 0;
+    header.patchSize = patch.serializedSize();
+    if (info.haveLayoutBounds)
+    {
+        memcpy(header.layoutBounds, &info.layoutBoundsLeft, sizeof(header.layoutBounds));
+    }
+    memcpy(header.outlineInsets, &info.outlineInsetsLeft, sizeof(header.outlineInsets));
+    header.outlineRadius = info.outlineRadius;
+    header.outlineAlpha = info.outlineAlpha;
+
+    out.resize(sizeof(header) + header.patchSize);
+    memcpy(out.data(), &header, sizeof(header));
+    Res_png_9patch::serialize(patch, info.xDivs, info.yDivs, info.colors, out.data() + sizeof(header));
+}
+
+static bool parse_metadata_binary(uint8_t const *data, size_t size, image_info *info)
+{
+    metadata_binary_header header;
+    if (size < sizeof(header) + 32)
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    uint8_t const *patch = data + sizeof(header);
+    if (header.version != METADATA_BINARY_VERSION || header.patchSize != size - sizeof(header) ||
+        header.patchSize != 32 + 4 * ((size_t)patch[1] + patch[2] + patch[3]))
+    {
+        return false;
+    }
+
+    memcpy(&info->info9Patch, patch, sizeof(Res_png_9patch));
+    info->info9Patch.wasDeserialized = false;
+    size_t xSize = info->info9Patch.numXDivs * sizeof(int32_t);
+    size_t ySize = info->info9Patch.numYDivs * sizeof(int32_t);
+    size_t colorsSize = info->info9Patch.numColors * sizeof(uint32_t);
+    info->xDivs = (int32_t *)malloc(xSize);
+    info->yDivs = (int32_t *)malloc(ySize);
+    info->colors = (uint32_t *)malloc(colorsSize);
+    memcpy(info->xDivs, patch + 32, xSize);
+    memcpy(info->yDivs, patch + 32 + xSize, ySize);
+    memcpy(info->colors, patch + 32 + xSize + ySize, colorsSize);
+    info->is9Patch = true;
+
+    info->haveLayoutBounds = (header.flags & METADATA_BINARY_LAYOUT_BOUNDS) != 0;
+    memcpy(&info->layoutBoundsLeft, header.layoutBounds, sizeof(header.layoutBounds));
+    memcpy(&info->outlineInsetsLeft, header.outlineInsets, sizeof(header.outlineInsets));
+    info->outlineRadius = header.outlineRadius;
+    info->outlineAlpha = (uint8_t)header.outlineAlpha;
+    return true;
+}
+
+static void write_metadata(image_info const &info, Bundle const *bundle, ::std::vector<uint8_t> &out)
+{
+    if (bundle && bundle->metadataFormat == METADATA_BINARY)
+    {
+        metadata_binary(info, out);
+    }
+    else
+    {
+        metadata_json(info, bundle, out);
+    }
+}
+
+// 根据开头的 magic 区分二进制与 json
+static bool parse_metadata(uint8_t const *data, size_t size, image_info *info)
+{
+    if (size >= 4 && memcmp(data, METADATA_BINARY_MAGIC, 4) == 0)
+    {
+        return parse_metadata_binary(data, size, info);
+    }
+    return parse_metadata_json(data, size, info);
+}
+
+char const *Aapt9PNGMetadataExtension(Bundle const *bundle)
+{
+    return bundle && bundle->metadataFormat == METADATA_BINARY ? ".9pm" : ".json";
+}
+
+bool LookupAapt9PNGIndex(Aapt9PNGIndex const &index, ::std::string const &name,
+                         ::std::vector<uint8_t> &outjson, Bundle const *bundle)
+{
+    Aapt9PNGIndexRecord const *record = index.find(name);
+    if (!record)
+    {
+        return false;
+    }
+
+    image_info info;
+    info.width = record->width;
+    info.height = record->height;
+    info.is9Patch = (record->flags & Aapt9PNGIndexRecord::NINE_PATCH) != 0;
+    info.info9Patch.numXDivs = record->numXDivs;
+    info.info9Patch.numYDivs = record->numYDivs;
+    info.info9Patch.numColors = record->numColors;
+    info.info9Patch.paddingLeft = record->padding[0];
+    info.info9Patch.paddingTop = record->padding[1];
+    info.info9Patch.paddingRight = record->padding[2];
+    info.info9Patch.paddingBottom = record->padding[3];
+    info.xDivs = (int32_t *)malloc(record->numXDivs * sizeof(int32_t));
+    info.yDivs = (int32_t *)malloc(record->numYDivs * sizeof(int32_t));
+    info.colors = (uint32_t *)malloc(record->numColors * sizeof(uint32_t));
+    memcpy(info.xDivs, index.xDivs(*record), record->numXDivs * sizeof(int32_t));
+    memcpy(info.yDivs, index.yDivs(*record), record->numYDivs * sizeof(int32_t));
+    memcpy(info.colors, index.colors(*record), record->numColors * sizeof(uint32_t));
+
+    info.haveLayoutBounds = (record->flags & Aapt9PNGIndexRecord::LAYOUT_BOUNDS) != 0;
+    memcpy(&info.layoutBoundsLeft, record->layoutBounds, sizeof(record->layoutBounds));
+    memcpy(&info.outlineInsetsLeft, record->outlineInsets, sizeof(record->outlineInsets));
+    info.outlineRadius = record->outlineRadius;
+    info.outlineAlpha = (uint8_t)record->outlineAlpha;
+
+    write_metadata(info, bundle, outjson);
+    return true;
+}
+
+static bool use_cache(Bundle const *bundle)
+{
+    return bundle && !bundle->cacheDir.empty();
+}
+
+static bool decode_file(::std::string const &input, MappedFile &mapped,
+                        ::std::string const &outjson, ::std::string const &outpng, Bundle const *bundle,
+                        Aapt9PNGError *error)
+{
+    // 不输出png时只需要.9信息, 跳过像素解码
+    if (outpng.empty())
+    {
+        ::std::vector<uint8_t> json;
+        return DecodeAapt9PNGMetadata(mapped.data(), mapped.size(), json, bundle, error) &&
+               save_file(outjson, json, error);
+    }
+
+    auto read_file = create_read_struct(error);
     auto read_info = png_create_info_struct(read_file);
 
     image_info info;
-    auto fp = fopen(input.c_str(), "rb");
-    if (!read_png_protected(read_file, input, read_info, input, fp, &info))
+    info.error = error;
+    png_memory_source source(mapped.data(), mapped.size());
+    if (!read_png_buffer_protected(read_file, input, read_info, &source, NINE_PATCH_CHUNKS, &info))
     {
         png_destroy_read_struct(&read_file, &read_info, nullptr);
-        fclose(fp);
         return false;
     }
+    png_destroy_read_struct(&read_file, &read_info, nullptr);
+    mapped.close();
 
     // 输出.9信息
-    Json::Value root;
-    ::std::ofstream stm(outjson);
-    stm << root.toStyledString();
-    stm.close();
+    ::std::vector<uint8_t> json;
+    write_metadata(info, bundle, json);
+    if (!save_file(outjson, json, error))
+    {
+        return false;
+    }
 
     // 输出普通png
-    auto write_file = png_create_write_struct(PNG_LIBPNG_VER_STRING, 0, nullptr, nullptr);
+    auto write_file = create_write_struct(error);
     auto write_info = png_create_info_struct(write_file);
 
     info.is9Patch = false;
-    write_png_protected(write_file, outpng, write_info, &info, nullptr);
+    remove_output(outpng);
+    bool suc = write_png_protected(write_file, outpng, write_info, &info, bundle);
+
+    png_destroy_write_struct(&write_file, &write_info);
+    return suc;
+}
+
+bool DecodeAapt9PNG(::std::string const &input, ::std::string const &outjson, ::std::string const &outpng,
+                    Bundle const *bundle, Aapt9PNGError *error)
+{
+    // libpng 直接从映射的文件读取, 不经过 stdio
+    MappedFile mapped;
+    if (!open_input(mapped, input, error))
+    {
+        return false;
+    }
+
+    ::std::vector<::std::string> outputs{outjson};
+    if (!outpng.empty())
+    {
+        outputs.push_back(outpng);
+    }
+
+    ::std::string key;
+    if (use_cache(bundle))
+    {
+        key = MakeAapt9PNGCacheKey(outpng.empty() ? "decode-metadata" : "decode", bundle,
+                                   {{mapped.data(), mapped.size()}});
+        if (FetchAapt9PNGCache(bundle->cacheDir, key, outputs))
+        {
+            return true;
+        }
+    }
+
+    if (!decode_file(input, mapped, outjson, outpng, bundle, error))
+    {
+        return false;
+    }
+
+    if (use_cache(bundle))
+    {
+        StoreAapt9PNGCache(bundle->cacheDir, key, outputs);
+    }
+    return true;
+}
 
+bool DecodeAapt9PNG(uint8_t const *input, size_t inputSize,
+                    ::std::vector<uint8_t> &outjson, ::std::vector<uint8_t> &outpng,
+                    Bundle const *bundle, Aapt9PNGError *error)
+{
+    auto read_file = create_read_struct(error);
+    auto read_info = png_create_info_struct(read_file);
+
+    image_info info;
+    info.error = error;
+    png_memory_source source(input, inputSize);
+    if (!read_png_buffer_protected(read_file, "<memory>", read_info, &source, NINE_PATCH_CHUNKS, &info))
+    {
+        png_destroy_read_struct(&read_file, &read_info, nullptr);
+        return false;
+    }
     png_destroy_read_struct(&read_file, &read_info, nullptr);
+
+    // 输出.9信息
+    write_metadata(info, bundle, outjson);
+
+    // 输出普通png
+    auto write_file = create_write_struct(error);
+    auto write_info = png_create_info_struct(write_file);
+
+    info.is9Patch = false;
+    outpng.clear();
+    bool suc = write_png_buffer_protected(write_file, "<memory>", write_info, &info, bundle, &outpng);
+
     png_destroy_write_struct(&write_file, &write_info);
-    fclose(fp);
-    return false;
+    return suc;
+}
+
+bool DecodeAapt9PNGMetadata(uint8_t const *input, size_t inputSize, ::std::vector<uint8_t> &outjson,
+                            Bundle const *bundle, Aapt9PNGError *error)
+{
+    image_info info;
+    if (!read_9patch_chunks_only(input, inputSize, &info))
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_PNG, "不是png或chunk已损坏");
+        return false;
+    }
+
+    write_metadata(info, bundle, outjson);
+    return true;
+}
+
+bool EncodeAapt9PNG(::std::string const &output, ::std::string const &injson, ::std::string const &inpng, Bundle const *bundle,
+                    Aapt9PNGError *error)
+{
+    MappedFile json, png;
+    ::std::vector<uint8_t> encoded;
+    if (!open_input(json, injson, error) || !open_input(png, inpng, error))
+    {
+        return false;
+    }
+
+    ::std::string key;
+    if (use_cache(bundle))
+    {
+        key = MakeAapt9PNGCacheKey("encode", bundle, {{json.data(), json.size()}, {png.data(), png.size()}});
+        if (FetchAapt9PNGCache(bundle->cacheDir, key, {output}))
+        {
+            return true;
+        }
+    }
+
+    if (!EncodeAapt9PNG(encoded, json.data(), json.size(), png.data(), png.size(), bundle, error) ||
+        !save_file(output, encoded, error))
+    {
+        return false;
+    }
+
+    if (use_cache(bundle))
+    {
+        StoreAapt9PNGCache(bundle->cacheDir, key, {output});
+    }
+    return true;
+}
+
+bool EncodeAapt9PNG(::std::vector<uint8_t> &output,
+                    uint8_t const *injson, size_t injsonSize,
+                    uint8_t const *inpng, size_t inpngSize,
+                    Bundle const *bundle, Aapt9PNGError *error)
+{
+    // 批处理的工作线程是常驻的, 线程内的连续调用共用同一组缓冲区
+    thread_local Aapt9PNGEncoder encoder;
+    return encoder.encode(output, injson, injsonSize, inpng, inpngSize, bundle, error);
 }
 
-bool EncodeAapt9PNG(::std::string const &output, ::std::string const &injson, ::std::string const &inpng, Bundle const *bundle)
+bool CompileAapt9PNG(::std::string const &output, ::std::string const &input, Bundle const *bundle,
+                     Aapt9PNGError *error)
 {
-    return false;
-}
\ No newline at end of file
+    MappedFile mapped;
+    ::std::vector<uint8_t> compiled;
+    if (!open_input(mapped, input, error))
+    {
+        return false;
+    }
+
+    ::std::string key;
+    if (use_cache(bundle))
+    {
+        key = MakeAapt9PNGCacheKey("compile", bundle, {{mapped.data(), mapped.size()}});
+        if (FetchAapt9PNGCache(bundle->cacheDir, key, {output}))
+        {
+            return true;
+        }
+    }
+
+    if (!CompileAapt9PNG(compiled, mapped.data(), mapped.size(), bundle, error) ||
+        !save_file(output, compiled, error))
+    {
+        return false;
+    }
+
+    if (use_cache(bundle))
+    {
+        StoreAapt9PNGCache(bundle->cacheDir, key, {output});
+    }
+    return true;
+}
+
+bool CompileAapt9PNG(::std::vector<uint8_t> &output, uint8_t const *input, size_t inputSize,
+                     Bundle const *bundle, Aapt9PNGError *error)
+{
+    thread_local Aapt9PNGEncoder encoder;
+    return encoder.compile(output, input, inputSize, bundle, error);
+}
+
+// 分割点必须递增且落在图片范围内
+static bool valid_divs(int32_t const *divs, int count, png_uint_32 size)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (divs[i] < 0 || (png_uint_32)divs[i] > size || (i > 0 && divs[i] < divs[i - 1]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 与 do_9patch 相同的方式计算一个方向上的色块数: 开头的 0 与结尾等于 size 的分割点不产生新的色块
+static int count_cells(int32_t const *divs, int count, png_uint_32 size)
+{
+    int cells = count + 1;
+    if (count > 0 && divs[0] == 0)
+    {
+        cells--;
+    }
+    if (count > 0 && (png_uint_32)divs[count - 1] == size)
+    {
+        cells--;
+    }
+    return cells;
+}
+
+// 分割点与内边距都必须落在 width x height 的图片之内, 颜色数必须等于色块数
+static bool valid_patch(image_info const &info, png_uint_32 width, png_uint_32 height)
+{
+    Res_png_9patch const &patch = info.info9Patch;
+    return valid_divs(info.xDivs, patch.numXDivs, width) &&
+           valid_divs(info.yDivs, patch.numYDivs, height) &&
+           count_cells(info.xDivs, patch.numXDivs, width) * count_cells(info.yDivs, patch.numYDivs, height) ==
+               patch.numColors &&
+           patch.paddingLeft >= 0 && patch.paddingRight >= 0 &&
+           patch.paddingTop >= 0 && patch.paddingBottom >= 0 &&
+           (int64_t)patch.paddingLeft + patch.paddingRight <= (int64_t)width &&
+           (int64_t)patch.paddingTop + patch.paddingBottom <= (int64_t)height;
+}
+
+Aapt9PNGEncoder::Aapt9PNGEncoder() : buffers_(new png_row_buffers())
+{
+}
+
+Aapt9PNGEncoder::~Aapt9PNGEncoder()
+{
+    delete buffers_;
+}
+
+bool Aapt9PNGEncoder::encode(::std::vector<uint8_t> &output,
+                             uint8_t const *injson, size_t injsonSize,
+                             uint8_t const *inpng, size_t inpngSize,
+                             Bundle const *bundle, Aapt9PNGError *error)
+{
+    image_info info;
+    info.error = error;
+    if (!parse_metadata(injson, injsonSize, &info))
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_METADATA, ".9信息格式有误");
+        return false;
+    }
+
+    // 输入已经是aapt处理过的.9.png时像素不变, 只替换.9信息, 跳过分析与压缩
+    image_info original;
+    if (read_9patch_chunks_only(inpng, inpngSize, &original) && original.is9Patch)
+    {
+        if (!valid_patch(info, original.width, original.height))
+        {
+            SetAapt9PNGError(error, AAPT9PNG_ERROR_METADATA, "分割点或内边距超出图片范围, 分割点未递增, 或颜色数与色块数不符");
+            return false;
+        }
+        if (!rewrite_9patch_chunks(inpng, inpngSize, info, &output))
+        {
+            SetAapt9PNGError(error, AAPT9PNG_ERROR_PNG, "png的chunk已损坏");
+            return false;
+        }
+        return true;
+    }
+
+    // 读取普通png, 像素行使用上下文中的缓冲区
+    info.buffers = buffers_;
+    auto read_file = create_read_struct(error);
+    auto read_info = png_create_info_struct(read_file);
+
+    png_memory_source source(inpng, inpngSize);
+    bool suc = read_png_buffer_protected(read_file, "<memory>", read_info, &source, NINE_PATCH_NONE, &info);
+    png_destroy_read_struct(&read_file, &read_info, nullptr);
+    if (!suc)
+    {
+        return false;
+    }
+    if (!valid_patch(info, info.width, info.height))
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_METADATA, "分割点或内边距超出图片范围, 分割点未递增, 或颜色数与色块数不符");
+        return false;
+    }
+
+    // 写出时附带 npTc/npOl/npLb
+    auto write_file = create_write_struct(error);
+    auto write_info = png_create_info_struct(write_file);
+
+    output.clear();
+    suc = write_png_buffer_protected(write_file, "<memory>", write_info, &info, bundle, &output);
+
+    png_destroy_write_struct(&write_file, &write_info);
+    return suc;
+}
+
+bool Aapt9PNGEncoder::compile(::std::vector<uint8_t> &output, uint8_t const *input, size_t inputSize,
+                              Bundle const *bundle, Aapt9PNGError *error)
+{
+    image_info info;
+    info.error = error;
+    info.buffers = buffers_;
+
+    // 读取时从边框得到.9信息, 像素行去掉边框
+    auto read_file = create_read_struct(error);
+    auto read_info = png_create_info_struct(read_file);
+
+    png_memory_source source(input, inputSize);
+    bool suc = read_png_buffer_protected(read_file, "<memory>", read_info, &source, NINE_PATCH_SOURCE, &info);
+    png_destroy_read_struct(&read_file, &read_info, nullptr);
+    if (!suc)
+    {
+        return false;
+    }
+
+    auto write_file = create_write_struct(error);
+    auto write_info = png_create_info_struct(write_file);
+
+    output.clear();
+    suc = write_png_buffer_protected(write_file, "<memory>", write_info, &info, bundle, &output);
+
+    png_destroy_write_struct(&write_file, &write_info);
+    return suc;
+}
@@ -2,17 +2,104 @@
 #define __9PNG_H_INCLUDED
 
 #include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include "9png-error.hpp"
 
 class Bundle;
+struct png_row_buffers;
+class Aapt9PNGIndex;
 
 /**
- * @brief 解压aapt处理过的9png
+ * 以下函数可以在多个线程中同时调用: 除日志级别外不使用全局状态, 也不调用 exit.
+ * error 不为空时记录失败原因与警告.
+ * 日志按运行时级别写到 stderr, 默认为 AAPT9PNG_LOG_WARN; 设为 AAPT9PNG_LOG_OFF 时不输出任何内容, 见 9png-log.hpp.
  */
-extern bool DecodeAapt9PNG(::std::string const &input, ::std::string const &outjson, ::std::string const &outpng);
+
+/**
+ * @brief 解压aapt处理过的9png, outpng 为空时只输出.9信息, 不解码像素
+ *
+ * .9信息按 bundle->metadataFormat 输出为 json 或二进制, 合并时根据开头的 magic 自动识别
+ */
+extern bool DecodeAapt9PNG(::std::string const &input, ::std::string const &outjson, ::std::string const &outpng,
+                           Bundle const *bundle = nullptr, Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 解压内存中aapt处理过的9png, 不经过临时文件
+ */
+extern bool DecodeAapt9PNG(uint8_t const *input, size_t inputSize,
+                           ::std::vector<uint8_t> &outjson, ::std::vector<uint8_t> &outpng,
+                           Bundle const *bundle = nullptr, Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 只读取.9信息, 遍历 chunk 至第一个 IDAT 为止, 不解码像素
+ */
+extern bool DecodeAapt9PNGMetadata(uint8_t const *input, size_t inputSize, ::std::vector<uint8_t> &outjson,
+                                   Bundle const *bundle = nullptr, Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief .9信息文件的扩展名, json 为 ".json", 二进制为 ".9pm"
+ */
+extern char const *Aapt9PNGMetadataExtension(Bundle const *bundle);
+
+/**
+ * @brief 从索引文件中按名称取出.9信息, 按 bundle->metadataFormat 输出
+ */
+extern bool LookupAapt9PNGIndex(Aapt9PNGIndex const &index, ::std::string const &name,
+                                ::std::vector<uint8_t> &outjson, Bundle const *bundle = nullptr);
 
 /**
  * @brief 合并
  */
-extern bool EncodeAapt9PNG(::std::string const &output, ::std::string const &injson, ::std::string const &inpng, Bundle const *bundle);
+extern bool EncodeAapt9PNG(::std::string const &output, ::std::string const &injson, ::std::string const &inpng, Bundle const *bundle,
+                           Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 在内存中合并, 不经过临时文件. 每个线程复用一个 Aapt9PNGEncoder
+ */
+extern bool EncodeAapt9PNG(::std::vector<uint8_t> &output,
+                           uint8_t const *injson, size_t injsonSize,
+                           uint8_t const *inpng, size_t inpngSize,
+                           Bundle const *bundle, Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 编译带1像素边框的原始.9.png, 与 aapt 编译资源时的输出相同
+ */
+extern bool CompileAapt9PNG(::std::string const &output, ::std::string const &input, Bundle const *bundle,
+                            Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 在内存中编译原始.9.png, 每个线程复用一个 Aapt9PNGEncoder
+ */
+extern bool CompileAapt9PNG(::std::vector<uint8_t> &output, uint8_t const *input, size_t inputSize,
+                            Bundle const *bundle, Aapt9PNGError *error = nullptr);
+
+/**
+ * @brief 可复用的合并上下文, 同一线程连续合并多张图片时复用像素行与转换缓冲区
+ *
+ * libpng 的 png_struct 写完一张图片后无法重置, 因此每次合并仍会重新创建.
+ * 不能在多个线程间共享.
+ */
+class Aapt9PNGEncoder
+{
+public:
+    Aapt9PNGEncoder();
+    ~Aapt9PNGEncoder();
+
+    bool encode(::std::vector<uint8_t> &output,
+                uint8_t const *injson, size_t injsonSize,
+                uint8_t const *inpng, size_t inpngSize,
+                Bundle const *bundle, Aapt9PNGError *error = nullptr);
+
+    bool compile(::std::vector<uint8_t> &output, uint8_t const *input, size_t inputSize,
+                 Bundle const *bundle, Aapt9PNGError *error = nullptr);
+
+private:
+    Aapt9PNGEncoder(Aapt9PNGEncoder const &);
+    Aapt9PNGEncoder &operator=(Aapt9PNGEncoder const &);
+
+    png_row_buffers *buffers_;
+};
 
 #endif
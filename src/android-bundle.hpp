@@ -1,11 +1,43 @@
 #ifndef __ANDROID_BUNDLE_H_INCLUDED
 #define __ANDROID_BUNDLE_H_INCLUDED
 
+#include <string>
+
+typedef enum
+{
+    COMPRESSION_FAST,    // zlib level 1, single filter
+    COMPRESSION_DEFAULT, // zlib default level, adaptive filters
+    COMPRESSION_BEST,    // Z_BEST_COMPRESSION, adaptive filters (aapt behaviour)
+    COMPRESSION_MAX      // try several zlib strategies/filters, keep the smallest
+} COMPRESSION_PROFILE;
+
+typedef enum
+{
+    METADATA_JSON,  // json, see DecodeAapt9PNG
+    METADATA_BINARY // Res_png_9patch layout plus layout bounds and outline
+} METADATA_FORMAT;
+
 class Bundle
 {
 public:
+    Bundle() : minSdk(0), grayscaleTolerance(0), compressionProfile(COMPRESSION_BEST), prettyJson(false),
+               metadataFormat(METADATA_JSON), trialThreads(0) {}
+
     int minSdk;
     int grayscaleTolerance;
+    int compressionProfile;
+
+    // 解压输出的 json 是否缩进换行
+    bool prettyJson;
+
+    // 解压输出的.9信息格式
+    int metadataFormat;
+
+    // 结果缓存目录, 为空时不使用缓存
+    ::std::string cacheDir;
+
+    // COMPRESSION_MAX 每张图片并行尝试的线程数, 0 为 cpu 核数
+    int trialThreads;
 };
 
 #endif
\ No newline at end of file
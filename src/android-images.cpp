@@ -2,6 +2,7 @@
 #include "android-images.hpp"
 #include "android-platform.hpp"
 #include "android-bundle.hpp"
+#include "pixel-kernels.hpp"
 #include <stdio.h>
 #include <string.h>
 #include <memory.h>
@@ -9,13 +10,15 @@
 #include <assert.h>
 #include <zlib.h>
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #define COLOR_TRANSPARENT 0
 #define COLOR_WHITE 0xFFFFFFFF
 #define COLOR_TICK 0xFF000000
 #define COLOR_LAYOUT_BOUNDS_TICK 0xFF0000FF
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define ABS(a) ((a) < 0 ? -(a) : (a))
+#define ROW_ALIGNMENT 32
 
 using ::std::max;
 
@@ -34,41 +37,210 @@ enum
     TICK_TYPE_BOTH
 };
 
+// Pixel at p as 0xAABBGGRR, the layout of the COLOR_* constants
+static inline uint32_t load_pixel(png_const_bytep p)
+{
+    uint32_t color;
+    memcpy(&color, p, sizeof(color));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    color = __builtin_bswap32(color);
+#endif
+    return color;
+}
+
 image_info::~image_info()
 {
-    if (rows && rows != allocRows)
+    if (!buffers)
     {
-        free(rows);
-    }
-    if (allocRows)
-    {
-        for (int i = 0; i < (int)allocHeight; i++)
-        {
-            free(allocRows[i]);
-        }
         free(allocRows);
+        free(pixels);
+        free(columns);
+        free(alphaBase);
     }
     free(xDivs);
     free(yDivs);
     free(colors);
 }
 
-static void log_warning(png_structp png_ptr, png_const_charp warning_message)
+png_bytep alloc_row_slab(png_uint_32 height, size_t rowBytes,
+                         size_t *outStride, png_bytepp *outRows)
+{
+    size_t stride = (rowBytes + ROW_ALIGNMENT - 1) & ~(size_t)(ROW_ALIGNMENT - 1);
+    void *slab = NULL;
+    png_bytepp rows = (png_bytepp)malloc(height * sizeof(png_bytep));
+    if (rows == NULL || posix_memalign(&slab, ROW_ALIGNMENT, height * stride) != 0)
+    {
+        free(rows);
+        return NULL;
+    }
+
+    for (png_uint_32 i = 0; i < height; i++)
+    {
+        rows[i] = (png_bytep)slab + i * stride;
+    }
+    *outStride = stride;
+    *outRows = rows;
+    return (png_bytep)slab;
+}
+
+png_row_buffers::~png_row_buffers()
+{
+    free(pixels);
+    free(rows);
+    free(scratch);
+    free(columns);
+    free(alpha);
+    free_chunks();
+}
+
+png_bytep png_row_buffers::alloc_pixels(png_uint_32 height, size_t rowBytes,
+                                        size_t *outStride, png_bytepp *outRows)
+{
+    size_t stride = (rowBytes + ROW_ALIGNMENT - 1) & ~(size_t)(ROW_ALIGNMENT - 1);
+    if (height > rowsCapacity)
+    {
+        free(rows);
+        rows = (png_bytepp)malloc(height * sizeof(png_bytep));
+        rowsCapacity = rows ? height : 0;
+    }
+    if (height * stride > pixelsCapacity)
+    {
+        void *slab = NULL;
+        free(pixels);
+        pixels = posix_memalign(&slab, ROW_ALIGNMENT, height * stride) == 0 ? (png_bytep)slab : NULL;
+        pixelsCapacity = pixels ? height * stride : 0;
+    }
+    if (rows == NULL || pixels == NULL)
+    {
+        return NULL;
+    }
+
+    for (png_uint_32 i = 0; i < height; i++)
+    {
+        rows[i] = pixels + i * stride;
+    }
+    *outStride = stride;
+    *outRows = rows;
+    return pixels;
+}
+
+png_bytep png_row_buffers::alloc_scratch(size_t size)
+{
+    if (size > scratchCapacity)
+    {
+        free(scratch);
+        scratch = (png_bytep)malloc(size);
+        scratchCapacity = scratch ? size : 0;
+    }
+    return scratch;
+}
+
+uint32_t *png_row_buffers::alloc_columns(size_t count)
+{
+    if (count > columnsCapacity)
+    {
+        free(columns);
+        columns = (uint32_t *)malloc(count * sizeof(uint32_t));
+        columnsCapacity = columns ? count : 0;
+    }
+    return columns;
+}
+
+png_bytep png_row_buffers::alloc_alpha(size_t size)
+{
+    if (size > alphaCapacity)
+    {
+        free(alpha);
+        alpha = (png_bytep)malloc(size);
+        alphaCapacity = alpha ? size : 0;
+    }
+    return alpha;
+}
+
+void png_row_buffers::free_chunks()
+{
+    for (int i = 0; i < 3; i++)
+    {
+        free(chunks[i].data);
+        chunks[i].data = NULL;
+    }
+}
+
+// Column and alpha plane storage for a source 9-patch, before any stripping
+static bool alloc_source_data(image_info *image)
+{
+    size_t count = (size_t)image->allocHeight * COLUMN_COUNT;
+    size_t size = (size_t)image->allocHeight * image->width;
+    if (image->buffers)
+    {
+        image->columns = image->buffers->alloc_columns(count);
+        image->alphaBase = image->buffers->alloc_alpha(size);
+    }
+    else
+    {
+        free(image->columns);
+        free(image->alphaBase);
+        image->columns = (uint32_t *)malloc(count * sizeof(uint32_t));
+        image->alphaBase = (png_bytep)malloc(size);
+    }
+    image->alpha = image->alphaBase;
+    image->alphaStride = image->width;
+    return image->columns != NULL && image->alphaBase != NULL;
+}
+
+static inline void gather_source_row(image_info *image, png_uint_32 y)
+{
+    png_bytep row = image->allocRows[y];
+    png_uint_32 h = image->allocHeight;
+    image->columns[COLUMN_LEFT * h + y] = load_pixel(row);
+    image->columns[COLUMN_RIGHT * h + y] = load_pixel(row + (image->width - 1) * 4);
+    image->columns[COLUMN_CENTER * h + y] = load_pixel(row + (image->width / 2) * 4);
+    extract_alpha(row, image->width, image->alphaBase + y * image->alphaStride);
+}
+
+bool gather_source_data(image_info *image)
+{
+    if (!alloc_source_data(image))
+    {
+        return false;
+    }
+    for (png_uint_32 y = 0; y < image->allocHeight; y++)
+    {
+        gather_source_row(image, y);
+    }
+    return true;
+}
+
+// libpng error/warning callbacks; the error pointer is the caller's Aapt9PNGError
+static void record_png_error(png_structp png_ptr, png_const_charp error_message)
+{
+    SetAapt9PNGError((Aapt9PNGError *)png_get_error_ptr(png_ptr), AAPT9PNG_ERROR_PNG, error_message);
+    png_longjmp(png_ptr, 1);
+}
+
+static void record_png_warning(png_structp png_ptr, png_const_charp warning_message)
+{
+    AddAapt9PNGWarning((Aapt9PNGError *)png_get_error_ptr(png_ptr), warning_message);
+}
+
+png_structp create_read_struct(Aapt9PNGError *error)
 {
-    const char *imageName = (const char *)png_get_error_ptr(png_ptr);
-    fprintf(stderr, "%s: libpng warning: %s\n", imageName, warning_message);
+    return png_create_read_struct(PNG_LIBPNG_VER_STRING, error, record_png_error, record_png_warning);
+}
+
+png_structp create_write_struct(Aapt9PNGError *error)
+{
+    return png_create_write_struct(PNG_LIBPNG_VER_STRING, error, record_png_error, record_png_warning);
 }
 
 void read_png(const char *imageName,
               png_structp read_ptr, png_infop read_info,
-              image_info *outImageInfo)
+              image_info *outImageInfo, bool sourceNinePatch)
 {
     int color_type;
     int bit_depth, interlace_type, compression_type;
-    int i;
 
-    png_set_error_fn(read_ptr, const_cast<char *>(imageName),
-                     NULL /* use default errorfn */, log_warning);
+    png_set_error_fn(read_ptr, outImageInfo->error, record_png_error, record_png_warning);
     png_read_info(read_ptr, read_info);
 
     png_get_IHDR(read_ptr, read_info, &outImageInfo->width,
@@ -96,35 +268,53 @@ void read_png(const char *imageName,
     if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(read_ptr);
 
-    png_set_interlace_handling(read_ptr);
+    int passes = png_set_interlace_handling(read_ptr);
 
     png_read_update_info(read_ptr, read_info);
 
-    outImageInfo->rows = (png_bytepp)malloc(
-        outImageInfo->height * sizeof(png_bytep));
+    size_t rowBytes = png_get_rowbytes(read_ptr, read_info);
+    outImageInfo->pixels = outImageInfo->buffers
+                               ? outImageInfo->buffers->alloc_pixels(outImageInfo->height, rowBytes,
+                                                                     &outImageInfo->stride, &outImageInfo->rows)
+                               : alloc_row_slab(outImageInfo->height, rowBytes,
+                                                &outImageInfo->stride, &outImageInfo->rows);
+    if (outImageInfo->pixels == NULL)
+    {
+        SetAapt9PNGError(outImageInfo->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't allocate image buffer");
+        png_error(read_ptr, "Can't allocate image buffer");
+    }
     outImageInfo->allocHeight = outImageInfo->height;
     outImageInfo->allocRows = outImageInfo->rows;
 
     png_set_rows(read_ptr, read_info, outImageInfo->rows);
 
-    for (i = 0; i < (int)outImageInfo->height; i++)
+    if (sourceNinePatch && !alloc_source_data(outImageInfo))
     {
-        outImageInfo->rows[i] = (png_bytep)
-            malloc(png_get_rowbytes(read_ptr, read_info));
+        SetAapt9PNGError(outImageInfo->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't allocate column buffer");
+        png_error(read_ptr, "Can't allocate column buffer");
     }
 
-    png_read_image(read_ptr, outImageInfo->rows);
+    // Same as png_read_image, but each finished row is still in cache when
+    // its columns and alpha are copied out
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (png_uint_32 y = 0; y < outImageInfo->height; y++)
+        {
+            png_read_row(read_ptr, outImageInfo->rows[y], NULL);
+            if (sourceNinePatch && pass == passes - 1)
+            {
+                gather_source_row(outImageInfo, y);
+            }
+        }
+    }
 
     png_read_end(read_ptr, read_info);
 
-    if (IS_DEBUG)
-    {
-        printf("Image %s: w=%d, h=%d, d=%d, colors=%d, inter=%d, comp=%d\n",
-               imageName,
-               (int)outImageInfo->width, (int)outImageInfo->height,
-               bit_depth, color_type,
-               interlace_type, compression_type);
-    }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Image %s: w=%d, h=%d, d=%d, colors=%d, inter=%d, comp=%d\n",
+                 imageName,
+                 (int)outImageInfo->width, (int)outImageInfo->height,
+                 bit_depth, color_type,
+                 interlace_type, compression_type);
 
     png_get_IHDR(read_ptr, read_info, &outImageInfo->width,
                  &outImageInfo->height, &bit_depth, &color_type,
@@ -168,8 +358,9 @@ status_t do_9patch(const char *imageName, image_info *image)
     const char *errorMsg = NULL;
     int errorPixel = -1;
     const char *errorEdge = NULL;
+    frame_edge edges[4];
+    ::std::vector<int32_t> patchCols, patchRows;
 
-    int colorIndex = 0;
 
     // Validate size...
     if (W < 3 || H < 3)
@@ -179,16 +370,28 @@ status_t do_9patch(const char *imageName, image_info *image)
     }
 
     // Validate frame...
-    if (!transparent &&
-        (p[0] != 0xFF || p[1] != 0xFF || p[2] != 0xFF || p[3] != 0xFF))
+    if (!transparent && load_pixel(p) != COLOR_WHITE)
     {
         errorMsg = "Must have one-pixel frame that is either transparent or white";
         goto getout;
     }
 
+    // The side edges are read from the columns gathered while decoding
+    if ((image->columns == NULL || image->alpha == NULL) && !gather_source_data(image))
+    {
+        SetAapt9PNGError(image->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't allocate column buffer");
+        return UNKNOWN_ERROR;
+    }
+
+    // Classify all four edges of the frame in one pass
+    scan_9patch_frame(image->rows[0], image->rows[H - 1],
+                      image->columns + COLUMN_LEFT * image->allocHeight,
+                      image->columns + COLUMN_RIGHT * image->allocHeight,
+                      W, H, transparent, edges);
+
     // Find left and right of sizing areas...
-    if (get_horizontal_ticks(p, W, transparent, true, &xDivs[0],
-                             &xDivs[1], &errorMsg, &numXDivs, true) != NO_ERROR)
+    if (get_ticks(edges[FRAME_TOP], true, &xDivs[0],
+                  &xDivs[1], &errorMsg, &numXDivs, true) != NO_ERROR)
     {
         errorPixel = xDivs[0];
         errorEdge = "top";
@@ -196,8 +399,8 @@ status_t do_9patch(const char *imageName, image_info *image)
     }
 
     // Find top and bottom of sizing areas...
-    if (get_vertical_ticks(image->rows, 0, H, transparent, true, &yDivs[0],
-                           &yDivs[1], &errorMsg, &numYDivs, true) != NO_ERROR)
+    if (get_ticks(edges[FRAME_LEFT], true, &yDivs[0],
+                  &yDivs[1], &errorMsg, &numYDivs, true) != NO_ERROR)
     {
         errorPixel = yDivs[0];
         errorEdge = "left";
@@ -209,8 +412,8 @@ status_t do_9patch(const char *imageName, image_info *image)
     image->info9Patch.numYDivs = numYDivs;
 
     // Find left and right of padding area...
-    if (get_horizontal_ticks(image->rows[H - 1], W, transparent, false, &image->info9Patch.paddingLeft,
-                             &image->info9Patch.paddingRight, &errorMsg, NULL, false) != NO_ERROR)
+    if (get_ticks(edges[FRAME_BOTTOM], false, &image->info9Patch.paddingLeft,
+                  &image->info9Patch.paddingRight, &errorMsg, NULL, false) != NO_ERROR)
     {
         errorPixel = image->info9Patch.paddingLeft;
         errorEdge = "bottom";
@@ -218,8 +421,8 @@ status_t do_9patch(const char *imageName, image_info *image)
     }
 
     // Find top and bottom of padding area...
-    if (get_vertical_ticks(image->rows, (W - 1) * 4, H, transparent, false, &image->info9Patch.paddingTop,
-                           &image->info9Patch.paddingBottom, &errorMsg, NULL, false) != NO_ERROR)
+    if (get_ticks(edges[FRAME_RIGHT], false, &image->info9Patch.paddingTop,
+                  &image->info9Patch.paddingBottom, &errorMsg, NULL, false) != NO_ERROR)
     {
         errorPixel = image->info9Patch.paddingTop;
         errorEdge = "right";
@@ -227,20 +430,17 @@ status_t do_9patch(const char *imageName, image_info *image)
     }
 
     // Find left and right of layout padding...
-    get_horizontal_layout_bounds_ticks(image->rows[H - 1], W, transparent, false,
-                                       &image->layoutBoundsLeft,
-                                       &image->layoutBoundsRight, &errorMsg);
+    get_layout_bounds_ticks(edges[FRAME_BOTTOM], &image->layoutBoundsLeft, &image->layoutBoundsRight);
 
-    get_vertical_layout_bounds_ticks(image->rows, (W - 1) * 4, H, transparent, false,
-                                     &image->layoutBoundsTop,
-                                     &image->layoutBoundsBottom, &errorMsg);
+    // Find top and bottom of layout padding...
+    get_layout_bounds_ticks(edges[FRAME_RIGHT], &image->layoutBoundsTop, &image->layoutBoundsBottom);
 
     image->haveLayoutBounds = image->layoutBoundsLeft != 0 || image->layoutBoundsRight != 0 || image->layoutBoundsTop != 0 || image->layoutBoundsBottom != 0;
 
-    if (image->haveLayoutBounds && IS_DEBUG)
+    if (image->haveLayoutBounds)
     {
-        printf("layoutBounds=%d %d %d %d\n", image->layoutBoundsLeft, image->layoutBoundsTop,
-               image->layoutBoundsRight, image->layoutBoundsBottom);
+        AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "layoutBounds=%d %d %d %d\n", image->layoutBoundsLeft, image->layoutBoundsTop,
+                     image->layoutBoundsRight, image->layoutBoundsBottom);
     }
 
     // use opacity of pixels to estimate the round rect outline
@@ -268,23 +468,21 @@ status_t do_9patch(const char *imageName, image_info *image)
         image->info9Patch.paddingBottom = H - 2 - image->info9Patch.paddingBottom;
     }
 
-    if (IS_DEBUG)
-    {
-        printf("Size ticks for %s: x0=%d, x1=%d, y0=%d, y1=%d\n", imageName,
-               xDivs[0], xDivs[1],
-               yDivs[0], yDivs[1]);
-        printf("padding ticks for %s: l=%d, r=%d, t=%d, b=%d\n", imageName,
-               image->info9Patch.paddingLeft, image->info9Patch.paddingRight,
-               image->info9Patch.paddingTop, image->info9Patch.paddingBottom);
-    }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Size ticks for %s: x0=%d, x1=%d, y0=%d, y1=%d\n", imageName,
+                 xDivs[0], xDivs[1],
+                 yDivs[0], yDivs[1]);
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "padding ticks for %s: l=%d, r=%d, t=%d, b=%d\n", imageName,
+                 image->info9Patch.paddingLeft, image->info9Patch.paddingRight,
+                 image->info9Patch.paddingTop, image->info9Patch.paddingBottom);
 
-    // Remove frame from image.
-    image->rows = (png_bytepp)malloc((H - 2) * sizeof(png_bytep));
-    for (i = 0; i < (H - 2); i++)
+    // Remove frame from image. The stripped image is a view into the decoded
+    // rows, one row down and one pixel in; no pixel is copied.
+    for (i = 1; i < H - 1; i++)
     {
-        image->rows[i] = image->allocRows[i + 1];
-        memmove(image->rows[i], image->rows[i] + 4, (W - 2) * 4);
+        image->allocRows[i] += 4;
     }
+    image->rows = image->allocRows + 1;
+    image->alpha += image->alphaStride + 1;
     image->width -= 2;
     W = image->width;
     image->height -= 2;
@@ -324,7 +522,6 @@ status_t do_9patch(const char *imageName, image_info *image)
 
     // Fill in color information for each patch.
 
-    uint32_t c;
     top = 0;
 
     // The first row always starts with the top being at y=0 and the bottom
@@ -355,196 +552,139 @@ status_t do_9patch(const char *imageName, image_info *image)
         {
             bottom = yDivs[j];
         }
-        left = 0;
-        // The initial xDiv and whether the first column is considered
-        // stretchable or not depends on whether xDiv[0] was zero or not.
-        for (i = xDivs[0] == 0 ? 1 : 0;
-             i <= numXDivs && left < W;
-             i++)
-        {
-            if (i == numXDivs)
-            {
-                right = W;
-            }
-            else
-            {
-                right = xDivs[i];
-            }
-            c = get_color(image->rows, left, top, right - 1, bottom - 1);
-            image->colors[colorIndex++] = c;
-
-            if (IS_DEBUG)
-            {
-                if (c != Res_png_9patch::NO_COLOR)
-                    hasColor = true;
-            }
-            left = right;
-        }
+        patchRows.push_back(top);
+        patchRows.push_back(bottom);
         top = bottom;
     }
 
-    assert(colorIndex == numColors);
-
-    for (i = 0; i < numColors; i++)
+    // The initial xDiv and whether the first column is considered
+    // stretchable or not depends on whether xDiv[0] was zero or not.
+    // Every row of patches uses the same columns.
+    left = 0;
+    for (i = xDivs[0] == 0 ? 1 : 0;
+         i <= numXDivs && left < W;
+         i++)
     {
-        if (hasColor)
+        if (i == numXDivs)
         {
-            if (i == 0)
-                printf("Colors in %s:\n ", imageName);
-            printf(" #%08x", image->colors[i]);
-            if (i == numColors - 1)
-                printf("\n");
+            right = W;
         }
-    }
-getout:
-    if (errorMsg)
-    {
-        fprintf(stderr,
-                "ERROR: 9-patch image %s malformed.\n"
-                "       %s.\n",
-                imageName, errorMsg);
-        if (errorEdge != NULL)
+        else
         {
-            if (errorPixel >= 0)
-            {
-                fprintf(stderr,
-                        "       Found at pixel #%d along %s edge.\n", errorPixel, errorEdge);
-            }
-            else
-            {
-                fprintf(stderr,
-                        "       Found along %s edge.\n", errorEdge);
-            }
+            right = xDivs[i];
         }
-        return UNKNOWN_ERROR;
+        patchCols.push_back(left);
+        patchCols.push_back(right);
+        left = right;
     }
-    return NO_ERROR;
-}
 
-status_t get_horizontal_ticks(
-    png_bytep row, int width, bool transparent, bool required,
-    int32_t *outLeft, int32_t *outRight, const char **outError,
-    uint8_t *outDivs, bool multipleAllowed)
-{
-    int i;
-    *outLeft = *outRight = -1;
-    int state = TICK_START;
-    bool found = false;
+    // get_patch_colors fills one color per cell into image->colors
+    if ((int)((patchRows.size() / 2) * (patchCols.size() / 2)) != numColors)
+    {
+        errorMsg = "9-patch cells do not match the number of colors";
+        goto getout;
+    }
+    get_patch_colors(image->rows, image->alpha, image->alphaStride,
+                     patchCols.data(), (int)patchCols.size() / 2,
+                     patchRows.data(), (int)patchRows.size() / 2, image->colors);
 
-    for (i = 1; i < width - 1; i++)
+    if (AAPT9PNG_LOG_ENABLED(AAPT9PNG_LOG_DEBUG))
     {
-        if (TICK_TYPE_TICK == tick_type(row + i * 4, transparent, outError))
+        for (i = 0; i < numColors && !hasColor; i++)
         {
-            if (state == TICK_START ||
-                (state == TICK_OUTSIDE_1 && multipleAllowed))
-            {
-                *outLeft = i - 1;
-                *outRight = width - 2;
-                found = true;
-                if (outDivs != NULL)
-                {
-                    *outDivs += 2;
-                }
-                state = TICK_INSIDE_1;
-            }
-            else if (state == TICK_OUTSIDE_1)
-            {
-                *outError = "Can't have more than one marked region along edge";
-                *outLeft = i;
-                return UNKNOWN_ERROR;
-            }
+            hasColor = image->colors[i] != Res_png_9patch::NO_COLOR;
         }
-        else if (*outError == NULL)
+        if (hasColor)
         {
-            if (state == TICK_INSIDE_1)
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Colors in %s:", imageName);
+            for (i = 0; i < numColors; i++)
             {
-                // We're done with this div.  Move on to the next.
-                *outRight = i - 1;
-                outRight += 2;
-                outLeft += 2;
-                state = TICK_OUTSIDE_1;
+                Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, " #%08x", image->colors[i]);
             }
-        }
-        else
-        {
-            *outLeft = i;
-            return UNKNOWN_ERROR;
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "\n");
         }
     }
-
-    if (required && !found)
+getout:
+    if (errorMsg)
     {
-        *outError = "No marked region found along edge";
-        *outLeft = -1;
+        SetAapt9PNGError(image->error, AAPT9PNG_ERROR_MALFORMED, errorMsg,
+                         errorEdge, errorEdge != NULL ? errorPixel : -1);
         return UNKNOWN_ERROR;
     }
-
     return NO_ERROR;
 }
 
-status_t get_horizontal_layout_bounds_ticks(
-    png_bytep row, int width, bool transparent, bool required,
-    int32_t *outLeft, int32_t *outRight, const char **outError)
+static inline void classify_frame_pixel(frame_edge &edge, int i, uint32_t color, bool transparent)
 {
-    int i;
-    *outLeft = *outRight = 0;
-
-    // Look for left tick
-    if (TICK_TYPE_LAYOUT_BOUNDS == tick_type(row + 4, transparent, outError))
+    const char *error = NULL;
+    edge.ticks[i] = (uint8_t)tick_type(color, transparent, &error);
+    if (error != NULL && edge.errorPixel < 0)
     {
-        // Starting with a layout padding tick
-        i = 1;
-        while (i < width - 1)
-        {
-            (*outLeft)++;
-            i++;
-            int tick = tick_type(row + i * 4, transparent, outError);
-            if (tick != TICK_TYPE_LAYOUT_BOUNDS)
-            {
-                break;
-            }
-        }
+        edge.errorPixel = i;
+        edge.error = error;
     }
+}
 
-    // Look for right tick
-    if (TICK_TYPE_LAYOUT_BOUNDS == tick_type(row + (width - 2) * 4, transparent, outError))
+void scan_9patch_frame(png_bytep top, png_bytep bottom, const uint32_t *left, const uint32_t *right,
+                       int width, int height, bool transparent, frame_edge edges[4])
+{
+    int i, j;
+    for (i = 0; i < 4; i++)
     {
-        // Ending with a layout padding tick
-        i = width - 2;
-        while (i > 1)
-        {
-            (*outRight)++;
-            i--;
-            int tick = tick_type(row + i * 4, transparent, outError);
-            if (tick != TICK_TYPE_LAYOUT_BOUNDS)
-            {
-                break;
-            }
-        }
+        edges[i].ticks.resize(i == FRAME_TOP || i == FRAME_BOTTOM ? width : height);
+        edges[i].errorPixel = -1;
+        edges[i].error = NULL;
     }
 
-    return NO_ERROR;
+    // Corners are only looked at by the layout bounds scan, never reported as errors
+    const char *ignored = NULL;
+    edges[FRAME_TOP].ticks[0] = edges[FRAME_LEFT].ticks[0] = tick_type(left[0], transparent, &ignored);
+    edges[FRAME_TOP].ticks[width - 1] = edges[FRAME_RIGHT].ticks[0] = tick_type(right[0], transparent, &ignored);
+    edges[FRAME_BOTTOM].ticks[0] = edges[FRAME_LEFT].ticks[height - 1] =
+        tick_type(left[height - 1], transparent, &ignored);
+    edges[FRAME_BOTTOM].ticks[width - 1] = edges[FRAME_RIGHT].ticks[height - 1] =
+        tick_type(right[height - 1], transparent, &ignored);
+
+    for (i = 1; i < width - 1; i++)
+    {
+        classify_frame_pixel(edges[FRAME_TOP], i, load_pixel(top + i * 4), transparent);
+        classify_frame_pixel(edges[FRAME_BOTTOM], i, load_pixel(bottom + i * 4), transparent);
+    }
+    for (j = 1; j < height - 1; j++)
+    {
+        classify_frame_pixel(edges[FRAME_LEFT], j, left[j], transparent);
+        classify_frame_pixel(edges[FRAME_RIGHT], j, right[j], transparent);
+    }
 }
 
-status_t get_vertical_ticks(
-    png_bytepp rows, int offset, int height, bool transparent, bool required,
-    int32_t *outTop, int32_t *outBottom, const char **outError,
+status_t get_ticks(
+    const frame_edge &edge, bool required,
+    int32_t *outStart, int32_t *outEnd, const char **outError,
     uint8_t *outDivs, bool multipleAllowed)
 {
     int i;
-    *outTop = *outBottom = -1;
+    const int length = (int)edge.ticks.size();
+    // Errors are reported through the first slot, whichever div was being filled
+    int32_t *outErrorPixel = outStart;
+    *outStart = *outEnd = -1;
     int state = TICK_START;
     bool found = false;
 
-    for (i = 1; i < height - 1; i++)
+    for (i = 1; i < length - 1; i++)
     {
-        if (TICK_TYPE_TICK == tick_type(rows[i] + offset, transparent, outError))
+        if (i == edge.errorPixel)
+        {
+            *outError = edge.error;
+            *outErrorPixel = i;
+            return UNKNOWN_ERROR;
+        }
+        if (TICK_TYPE_TICK == edge.ticks[i])
         {
             if (state == TICK_START ||
                 (state == TICK_OUTSIDE_1 && multipleAllowed))
             {
-                *outTop = i - 1;
-                *outBottom = height - 2;
+                *outStart = i - 1;
+                *outEnd = length - 2;
                 found = true;
                 if (outDivs != NULL)
                 {
@@ -555,94 +695,110 @@ status_t get_vertical_ticks(
             else if (state == TICK_OUTSIDE_1)
             {
                 *outError = "Can't have more than one marked region along edge";
-                *outTop = i;
+                *outErrorPixel = i;
                 return UNKNOWN_ERROR;
             }
         }
-        else if (*outError == NULL)
+        else if (state == TICK_INSIDE_1)
         {
-            if (state == TICK_INSIDE_1)
-            {
-                // We're done with this div.  Move on to the next.
-                *outBottom = i - 1;
-                outTop += 2;
-                outBottom += 2;
-                state = TICK_OUTSIDE_1;
-            }
-        }
-        else
-        {
-            *outTop = i;
-            return UNKNOWN_ERROR;
+            // We're done with this div.  Move on to the next.
+            *outEnd = i - 1;
+            outStart += 2;
+            outEnd += 2;
+            state = TICK_OUTSIDE_1;
         }
     }
 
     if (required && !found)
     {
         *outError = "No marked region found along edge";
-        *outTop = -1;
+        *outErrorPixel = -1;
         return UNKNOWN_ERROR;
     }
 
     return NO_ERROR;
 }
 
-status_t get_vertical_layout_bounds_ticks(
-    png_bytepp rows, int offset, int height, bool transparent, bool required,
-    int32_t *outTop, int32_t *outBottom, const char **outError)
+void get_layout_bounds_ticks(const frame_edge &edge, int32_t *outStart, int32_t *outEnd)
 {
     int i;
-    *outTop = *outBottom = 0;
+    const int length = (int)edge.ticks.size();
+    *outStart = *outEnd = 0;
 
-    // Look for top tick
-    if (TICK_TYPE_LAYOUT_BOUNDS == tick_type(rows[1] + offset, transparent, outError))
+    // Look for the leading tick
+    if (TICK_TYPE_LAYOUT_BOUNDS == edge.ticks[1])
     {
         // Starting with a layout padding tick
         i = 1;
-        while (i < height - 1)
+        while (i < length - 1)
         {
-            (*outTop)++;
+            (*outStart)++;
             i++;
-            int tick = tick_type(rows[i] + offset, transparent, outError);
-            if (tick != TICK_TYPE_LAYOUT_BOUNDS)
+            if (edge.ticks[i] != TICK_TYPE_LAYOUT_BOUNDS)
             {
                 break;
             }
         }
     }
 
-    // Look for bottom tick
-    if (TICK_TYPE_LAYOUT_BOUNDS == tick_type(rows[height - 2] + offset, transparent, outError))
+    // Look for the trailing tick
+    if (TICK_TYPE_LAYOUT_BOUNDS == edge.ticks[length - 2])
     {
         // Ending with a layout padding tick
-        i = height - 2;
+        i = length - 2;
         while (i > 1)
         {
-            (*outBottom)++;
+            (*outEnd)++;
             i--;
-            int tick = tick_type(rows[i] + offset, transparent, outError);
-            if (tick != TICK_TYPE_LAYOUT_BOUNDS)
+            if (edge.ticks[i] != TICK_TYPE_LAYOUT_BOUNDS)
             {
                 break;
             }
         }
     }
+}
 
-    return NO_ERROR;
+// find_max_opacity along one row of the alpha plane, d = 1 or -1. The
+// first opaque pixel ends the march, otherwise it stops at the first maximum.
+static void find_max_opacity_run(const png_byte *alpha, int start, int end, int d, int *out_inset)
+{
+    *out_inset = 0;
+    if (d > 0 ? start >= end : start <= end)
+    {
+        return;
+    }
+
+    size_t count = d > 0 ? end - start : start - end;
+    const png_byte *base = d > 0 ? alpha + start : alpha + end + 1;
+    size_t found = d > 0 ? alpha_find(base, count, 0xff) : alpha_rfind(base, count, 0xff);
+    if (found == count)
+    {
+        uint8_t max_opacity = alpha_max(base, count);
+        if (max_opacity == 0)
+        {
+            return;
+        }
+        found = d > 0 ? alpha_find(base, count, max_opacity) : alpha_rfind(base, count, max_opacity);
+    }
+    *out_inset = (int)(d > 0 ? found : count - 1 - found);
 }
 
-void find_max_opacity(png_byte **rows,
+void find_max_opacity(const png_byte *alpha, size_t stride,
                       int startX, int startY, int endX, int endY, int dX, int dY,
                       int *out_inset)
 {
-    bool opaque_within_inset = true;
+    if (dY == 0 && (dX == 1 || dX == -1))
+    {
+        find_max_opacity_run(alpha + startY * stride, startX, endX, dX, out_inset);
+        return;
+    }
+
     uint8_t max_opacity = 0;
     int inset = 0;
     *out_inset = 0;
     for (int x = startX, y = startY; x != endX && y != endY; x += dX, y += dY, inset++)
     {
-        png_byte *color = rows[y] + x * 4;
-        uint8_t opacity = color[3];
+        uint8_t opacity = alpha[y * stride + x];
         if (opacity > max_opacity)
         {
             max_opacity = opacity;
@@ -653,28 +809,27 @@ void find_max_opacity(png_byte **rows,
     }
 }
 
-uint8_t max_alpha_over_row(png_byte *row, int startX, int endX)
+uint8_t max_alpha_over_row(const png_byte *alpha, int startX, int endX)
 {
-    uint8_t max_alpha = 0;
-    for (int x = startX; x < endX; x++)
-    {
-        uint8_t alpha = (row + x * 4)[3];
-        if (alpha > max_alpha)
-            max_alpha = alpha;
-    }
-    return max_alpha;
+    return startX < endX ? alpha_max(alpha + startX, endX - startX) : 0;
 }
 
-uint8_t max_alpha_over_col(png_byte **rows, int offsetX, int startY, int endY)
+void find_max_opacity_col(const uint32_t *column, int start, int end, int d, int *out_inset)
 {
-    uint8_t max_alpha = 0;
-    for (int y = startY; y < endY; y++)
+    uint32_t max_opacity = 0;
+    int inset = 0;
+    *out_inset = 0;
+    for (int y = start; y != end; y += d, inset++)
     {
-        uint8_t alpha = (rows[y] + offsetX * 4)[3];
-        if (alpha > max_alpha)
-            max_alpha = alpha;
+        uint32_t opacity = column[y] >> 24;
+        if (opacity > max_opacity)
+        {
+            max_opacity = opacity;
+            *out_inset = inset;
+        }
+        if (opacity == 0xff)
+            return;
     }
-    return max_alpha;
 }
 
 void get_outline(image_info *image)
@@ -687,8 +842,10 @@ void get_outline(image_info *image)
     // find left and right extent of nine patch content on center row
     if (image->width > 4)
     {
-        find_max_opacity(image->rows, 1, midY, midX, -1, 1, 0, &image->outlineInsetsLeft);
-        find_max_opacity(image->rows, endX, midY, midX, -1, -1, 0, &image->outlineInsetsRight);
+        find_max_opacity(image->alpha, image->alphaStride, 1, midY, midX, -1, 1, 0,
+                         &image->outlineInsetsLeft);
+        find_max_opacity(image->alpha, image->alphaStride, endX, midY, midX, -1, -1, 0,
+                         &image->outlineInsetsRight);
     }
     else
     {
@@ -699,8 +856,9 @@ void get_outline(image_info *image)
     // find top and bottom extent of nine patch content on center column
     if (image->height > 4)
     {
-        find_max_opacity(image->rows, midX, 1, -1, midY, 0, 1, &image->outlineInsetsTop);
-        find_max_opacity(image->rows, midX, endY, -1, midY, 0, -1, &image->outlineInsetsBottom);
+        const uint32_t *center = image->columns + COLUMN_CENTER * image->allocHeight;
+        find_max_opacity_col(center, 1, midY, 1, &image->outlineInsetsTop);
+        find_max_opacity_col(center, endY, midY, -1, &image->outlineInsetsBottom);
     }
     else
     {
@@ -716,12 +874,14 @@ void get_outline(image_info *image)
     int innerMidY = (innerEndY + innerStartY) / 2;
 
     // assuming the image is a round rect, compute the radius by marching
-    // diagonally from the top left corner towards the center
-    image->outlineAlpha = max(max_alpha_over_row(image->rows[innerMidY], innerStartX, innerEndX),
-                              max_alpha_over_col(image->rows, innerMidX, innerStartY, innerStartY));
+    // diagonally from the top left corner towards the center.
+    // aapt also took the max over column innerMidX, but from innerStartY to
+    // innerStartY, which is always empty.
+    image->outlineAlpha = max_alpha_over_row(image->alpha + innerMidY * image->alphaStride,
+                                             innerStartX, innerEndX);
 
     int diagonalInset = 0;
-    find_max_opacity(image->rows, innerStartX, innerStartY, innerMidX, innerMidY, 1, 1,
+    find_max_opacity(image->alpha, image->alphaStride, innerStartX, innerStartY, innerMidX, innerMidY, 1, 1,
                      &diagonalInset);
 
     /* Determine source radius based upon inset:
@@ -732,16 +892,13 @@ void get_outline(image_info *image)
      */
     image->outlineRadius = 3.4142f * diagonalInset;
 
-    if (IS_DEBUG)
-    {
-        printf("outline insets %d %d %d %d, rad %f, alpha %x\n",
-               image->outlineInsetsLeft,
-               image->outlineInsetsTop,
-               image->outlineInsetsRight,
-               image->outlineInsetsBottom,
-               image->outlineRadius,
-               image->outlineAlpha);
-    }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "outline insets %d %d %d %d, rad %f, alpha %x\n",
+                 image->outlineInsetsLeft,
+                 image->outlineInsetsTop,
+                 image->outlineInsetsRight,
+                 image->outlineInsetsBottom,
+                 image->outlineRadius,
+                 image->outlineAlpha);
 }
 
 uint32_t get_color(
@@ -781,6 +938,63 @@ uint32_t get_color(
     return (color[3] << 24) | (color[0] << 16) | (color[1] << 8) | color[2];
 }
 
+void get_patch_colors(png_bytepp rows, const png_byte *alpha, size_t alphaStride,
+                      const int32_t *cols, int numCols,
+                      const int32_t *patchRows, int numRows, uint32_t *colors)
+{
+    // numRows * numCols is at most 0x7F, checked by do_9patch
+    bool pending[0x80];
+
+    for (int r = 0; r < numRows; r++)
+    {
+        const int top = patchRows[2 * r];
+        const int bottom = patchRows[2 * r + 1];
+        uint32_t *out = colors + r * numCols;
+        int live = 0;
+
+        for (int c = 0; c < numCols; c++)
+        {
+            pending[c] = cols[2 * c] < cols[2 * c + 1] && top < bottom;
+            out[c] = Res_png_9patch::TRANSPARENT_COLOR;
+            live += pending[c];
+        }
+
+        // Each row of the patch band is read once; a cell drops out at its
+        // first pixel that differs from its top-left pixel
+        for (int y = top; y < bottom && live > 0; y++)
+        {
+            for (int c = 0; c < numCols; c++)
+            {
+                if (!pending[c])
+                {
+                    continue;
+                }
+                // Transparent cells only need the alpha plane, a quarter of the bytes
+                const int left = cols[2 * c];
+                const int width = cols[2 * c + 1] - left;
+                const bool uniform = alpha != NULL && rows[top][left * 4 + 3] == 0
+                                         ? alpha_max(alpha + y * alphaStride + left, width) == 0
+                                         : pixels_uniform(rows[y] + left * 4, width, rows[top] + left * 4);
+                if (!uniform)
+                {
+                    pending[c] = false;
+                    out[c] = Res_png_9patch::NO_COLOR;
+                    live--;
+                }
+            }
+        }
+
+        for (int c = 0; c < numCols; c++)
+        {
+            png_bytep color = rows[top] + cols[2 * c] * 4;
+            if (pending[c] && color[3] != 0)
+            {
+                out[c] = (color[3] << 24) | (color[0] << 16) | (color[1] << 8) | color[2];
+            }
+        }
+    }
+}
+
 void select_patch(
     int which, int front, int back, int size, int *start, int *end)
 {
@@ -813,20 +1027,17 @@ uint32_t get_color(image_info *image, int hpatch, int vpatch)
     // printf("Selecting h=%d v=%d: (%d,%d)-(%d,%d)\n",
     //        hpatch, vpatch, left, top, right, bottom);
     const uint32_t c = get_color(image->rows, left, top, right, bottom);
-    if (IS_DEBUG)
-    {
-        printf("Color in (%d,%d)-(%d,%d): #%08x\n", left, top, right, bottom, c);
-    }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_VERBOSE, "Color in (%d,%d)-(%d,%d): #%08x\n", left, top, right, bottom, c);
     return c;
 }
 
-int tick_type(png_bytep p, bool transparent, const char **outError)
+int tick_type(uint32_t color, bool transparent, const char **outError)
 {
-    png_uint_32 color = p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+    const uint32_t alpha = color >> 24;
 
     if (transparent)
     {
-        if (p[3] == 0)
+        if (alpha == 0)
         {
             return TICK_TYPE_NONE;
         }
@@ -840,22 +1051,15 @@ int tick_type(png_bytep p, bool transparent, const char **outError)
         }
 
         // Error cases
-        if (p[3] != 0xff)
+        if (alpha != 0xff)
         {
             *outError = "Frame pixels must be either solid or transparent (not intermediate alphas)";
             return TICK_TYPE_NONE;
         }
-        if (p[0] != 0 || p[1] != 0 || p[2] != 0)
-        {
-            *outError = "Ticks in transparent frame must be black or red";
-        }
+        *outError = "Ticks in transparent frame must be black or red";
         return TICK_TYPE_TICK;
     }
 
-    if (p[3] != 0xFF)
-    {
-        *outError = "White frame must be a solid color (no alpha)";
-    }
     if (color == COLOR_WHITE)
     {
         return TICK_TYPE_NONE;
@@ -869,22 +1073,26 @@ int tick_type(png_bytep p, bool transparent, const char **outError)
         return TICK_TYPE_LAYOUT_BOUNDS;
     }
 
-    if (p[0] != 0 || p[1] != 0 || p[2] != 0)
+    if (alpha != 0xff)
     {
-        *outError = "Ticks in white frame must be black or red";
+        *outError = "White frame must be a solid color (no alpha)";
         return TICK_TYPE_NONE;
     }
-    return TICK_TYPE_TICK;
+    *outError = "Ticks in white frame must be black or red";
+    return TICK_TYPE_NONE;
 }
 
-void checkNinePatchSerialization(Res_png_9patch *inPatch, void *data)
+void checkNinePatchSerialization(image_info *image, void *data)
 {
+    Res_png_9patch *inPatch = &image->info9Patch;
     size_t patchSize = inPatch->serializedSize();
     void *newData = malloc(patchSize);
     memcpy(newData, data, patchSize);
     Res_png_9patch *outPatch = inPatch->deserialize(newData);
     // deserialization is done in place, so outPatch == newData
     assert(outPatch == newData);
+    // the serialized data is in file (network) byte order
+    outPatch->fileToDevice();
     assert(outPatch->numXDivs == inPatch->numXDivs);
     assert(outPatch->numYDivs == inPatch->numYDivs);
     assert(outPatch->paddingLeft == inPatch->paddingLeft);
@@ -893,21 +1101,26 @@ void checkNinePatchSerialization(Res_png_9patch *inPatch, void *data)
     assert(outPatch->paddingBottom == inPatch->paddingBottom);
     for (int i = 0; i < outPatch->numXDivs; i++)
     {
-        assert(outPatch->getXDivs()[i] == inPatch->getXDivs()[i]);
+        assert(outPatch->getXDivs()[i] == image->xDivs[i]);
     }
     for (int i = 0; i < outPatch->numYDivs; i++)
     {
-        assert(outPatch->getYDivs()[i] == inPatch->getYDivs()[i]);
+        assert(outPatch->getYDivs()[i] == image->yDivs[i]);
     }
     for (int i = 0; i < outPatch->numColors; i++)
     {
-        assert(outPatch->getColors()[i] == inPatch->getColors()[i]);
+        assert(outPatch->getColors()[i] == image->colors[i]);
     }
     free(newData);
 }
 
 void dump_image(int w, int h, png_bytepp rows, int color_type)
 {
+    if (!AAPT9PNG_LOG_ENABLED(AAPT9PNG_LOG_VERBOSE))
+    {
+        return;
+    }
+
     int i, j, rr, gg, bb, aa;
 
     int bpp;
@@ -926,12 +1139,16 @@ void dump_image(int w, int h, png_bytepp rows, int color_type)
     }
     else
     {
-        printf("Unknown color type %d.\n", color_type);
+        Aapt9PNGLog(AAPT9PNG_LOG_ERROR, "Unknown color type %d.\n", color_type);
+        return;
     }
 
+    // Each row is formatted locally and logged as a single line
+    ::std::vector<char> line(w * 20 + 32);
     for (j = 0; j < h; j++)
     {
         png_bytep row = rows[j];
+        int n = snprintf(line.data(), line.size(), "Row %d:", j);
         for (i = 0; i < w; i++)
         {
             rr = row[0];
@@ -940,44 +1157,39 @@ void dump_image(int w, int h, png_bytepp rows, int color_type)
             aa = row[3];
             row += bpp;
 
-            if (i == 0)
-            {
-                printf("Row %d:", j);
-            }
+            char *out = line.data() + n;
+            size_t room = line.size() - n;
             switch (bpp)
             {
             case 1:
-                printf(" (%d)", rr);
+                n += snprintf(out, room, " (%d)", rr);
                 break;
             case 2:
-                printf(" (%d %d", rr, gg);
+                n += snprintf(out, room, " (%d %d", rr, gg);
                 break;
             case 3:
-                printf(" (%d %d %d)", rr, gg, bb);
+                n += snprintf(out, room, " (%d %d %d)", rr, gg, bb);
                 break;
             case 4:
-                printf(" (%d %d %d %d)", rr, gg, bb, aa);
+                n += snprintf(out, room, " (%d %d %d %d)", rr, gg, bb, aa);
                 break;
             }
-            if (i == (w - 1))
-            {
-                if (IS_DEBUG)
-                {
-                    printf("\n");
-                }
-            }
         }
+        Aapt9PNGLog(AAPT9PNG_LOG_VERBOSE, "%s\n", line.data());
     }
 }
 
 void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTolerance,
-                   png_colorp rgbPalette, png_bytep alphaPalette,
-                   int *paletteEntries, bool *hasTransparency, int *colorType,
-                   png_bytepp outRows)
+                   image_analysis *analysis)
 {
     int w = imageInfo.width;
     int h = imageInfo.height;
-    int i, j, rr, gg, bb, aa, idx;
+    int i, j, rr, gg, bb, aa;
+    png_colorp rgbPalette = analysis->rgbPalette;
+    png_bytep alphaPalette = analysis->alphaPalette;
+    int *paletteEntries = &analysis->paletteEntries;
+    bool *hasTransparency = &analysis->hasTransparency;
+    int *colorType = &analysis->colorType;
     uint32_t colors[256], col;
     int num_colors = 0;
     int maxGrayDeviation = 0;
@@ -986,6 +1198,14 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
     bool isPalette = true;
     bool isGrayscale = true;
 
+    // Palette lookups go through a hash of the colors seen so far, with the
+    // previous pixel's index cached for runs of identical pixels.
+    color_table &colorTable = analysis->colorTable;
+    uint32_t lastCol = 0;
+    int lastIdx = -1;
+    // Where the palette overflowed, reported once the scan is done
+    int overflowX = -1, overflowY = -1;
+
     // Scan the entire image and determine if:
     // 1. Every pixel has R == G == B (grayscale)
     // 2. Every pixel has A == 255 (opaque)
@@ -994,10 +1214,19 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
     // NOISY(printf("Initial image data:\n"));
     // dump_image(w, h, imageInfo.rows, PNG_COLOR_TYPE_RGB_ALPHA);
 
+    // Grayscale and opacity are decided by a vectorized pass over each row
+    int minAlpha = 0xff;
     for (j = 0; j < h; j++)
+    {
+        scan_gray_opacity(imageInfo.rows[j], w, &maxGrayDeviation, &minAlpha);
+    }
+    isGrayscale = maxGrayDeviation == 0;
+    isOpaque = minAlpha == 0xff;
+
+    // Only the palette is kept; indices are looked up again when rows are written
+    for (j = 0; j < h && isPalette; j++)
     {
         png_bytep row = imageInfo.rows[j];
-        png_bytep out = outRows[j];
         for (i = 0; i < w; i++)
         {
             rr = *row++;
@@ -1005,74 +1234,28 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
             bb = *row++;
             aa = *row++;
 
-            int odev = maxGrayDeviation;
-            maxGrayDeviation = MAX(ABS(rr - gg), maxGrayDeviation);
-            maxGrayDeviation = MAX(ABS(gg - bb), maxGrayDeviation);
-            maxGrayDeviation = MAX(ABS(bb - rr), maxGrayDeviation);
-            if (maxGrayDeviation > odev && IS_DEBUG)
-            {
-                printf("New max dev. = %d at pixel (%d, %d) = (%d %d %d %d)\n",
-                       maxGrayDeviation, i, j, rr, gg, bb, aa);
-            }
-
-            // Check if image is really grayscale
-            if (isGrayscale)
-            {
-                if (rr != gg || rr != bb)
-                {
-                    if (IS_DEBUG)
-                    {
-                        printf("Found a non-gray pixel at %d, %d = (%d %d %d %d)\n",
-                               i, j, rr, gg, bb, aa);
-                    }
-                    isGrayscale = false;
-                }
-            }
-
-            // Check if image is really opaque
-            if (isOpaque)
-            {
-                if (aa != 0xff)
-                {
-                    if (IS_DEBUG)
-                    {
-                        printf("Found a non-opaque pixel at %d, %d = (%d %d %d %d)\n",
-                               i, j, rr, gg, bb, aa);
-                    }
-                    isOpaque = false;
-                }
-            }
-
             // Check if image is really <= 256 colors
             if (isPalette)
             {
                 col = (uint32_t)((rr << 24) | (gg << 16) | (bb << 8) | aa);
-                bool match = false;
-                for (idx = 0; idx < num_colors; idx++)
+                bool match = true;
+                if (col != lastCol || lastIdx < 0)
                 {
-                    if (colors[idx] == col)
-                    {
-                        match = true;
-                        break;
-                    }
+                    lastCol = col;
+                    lastIdx = colorTable.find(col);
+                    match = lastIdx >= 0;
                 }
-
-                // Write the palette index for the pixel to outRows optimistically
-                // We might overwrite it later if we decide to encode as gray or
-                // gray + alpha
-                *out++ = idx;
                 if (!match)
                 {
                     if (num_colors == 256)
                     {
-                        if (IS_DEBUG)
-                        {
-                            printf("Found 257th color at %d, %d\n", i, j);
-                        }
+                        overflowX = i;
+                        overflowY = j;
                         isPalette = false;
                     }
                     else
                     {
+                        colorTable.insert(col, num_colors);
                         colors[num_colors++] = col;
                     }
                 }
@@ -1082,18 +1265,21 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
 
     *paletteEntries = 0;
     *hasTransparency = !isOpaque;
+    analysis->isGrayscale = isGrayscale;
+    analysis->isOpaque = isOpaque;
     int bpp = isOpaque ? 3 : 4;
     int paletteSize = w * h + bpp * num_colors;
 
-    if (IS_DEBUG)
+    if (!isPalette)
     {
-        printf("isGrayscale = %s\n", isGrayscale ? "true" : "false");
-        printf("isOpaque = %s\n", isOpaque ? "true" : "false");
-        printf("isPalette = %s\n", isPalette ? "true" : "false");
-        printf("Size w/ palette = %d, gray+alpha = %d, rgb(a) = %d\n",
-               paletteSize, 2 * w * h, bpp * w * h);
-        printf("Max gray deviation = %d, tolerance = %d\n", maxGrayDeviation, grayscaleTolerance);
+        AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Found 257th color at %d, %d\n", overflowX, overflowY);
     }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "isGrayscale = %s\n", isGrayscale ? "true" : "false");
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "isOpaque = %s\n", isOpaque ? "true" : "false");
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "isPalette = %s\n", isPalette ? "true" : "false");
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Size w/ palette = %d, gray+alpha = %d, rgb(a) = %d\n",
+                 paletteSize, 2 * w * h, bpp * w * h);
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Max gray deviation = %d, tolerance = %d\n", maxGrayDeviation, grayscaleTolerance);
 
     // Choose the best color type for the image.
     // 1. Opaque gray - use COLOR_TYPE_GRAY at 1 byte/pixel
@@ -1131,7 +1317,7 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
     {
         if (maxGrayDeviation <= grayscaleTolerance)
         {
-            printf("%s: forcing image to gray (max deviation = %d)\n", imageName, maxGrayDeviation);
+            AAPT9PNG_LOG(AAPT9PNG_LOG_INFO, "%s: forcing image to gray (max deviation = %d)\n", imageName, maxGrayDeviation);
             *colorType = isOpaque ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_GRAY_ALPHA;
         }
         else
@@ -1158,83 +1344,50 @@ void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTo
             alphaPalette[idx] = (png_byte)(col & 0xff);
         }
     }
-    else if (*colorType == PNG_COLOR_TYPE_GRAY || *colorType == PNG_COLOR_TYPE_GRAY_ALPHA)
-    {
-        // If the image is gray or gray + alpha, compact the pixels into outRows
-        for (j = 0; j < h; j++)
-        {
-            png_bytep row = imageInfo.rows[j];
-            png_bytep out = outRows[j];
-            for (i = 0; i < w; i++)
-            {
-                rr = *row++;
-                gg = *row++;
-                bb = *row++;
-                aa = *row++;
-
-                if (isGrayscale)
-                {
-                    *out++ = rr;
-                }
-                else
-                {
-                    *out++ = (png_byte)(rr * 0.2126f + gg * 0.7152f + bb * 0.0722f);
-                }
-                if (!isOpaque)
-                {
-                    *out++ = aa;
-                }
-            }
-        }
-    }
 }
 
-void write_png(const char *imageName,
-               png_structp write_ptr, png_infop write_info,
-               image_info &imageInfo, const Bundle *bundle)
+png_bytep convert_row(const image_analysis &analysis, png_bytep row, int width, png_bytep out)
 {
-    png_uint_32 width, height;
-    int color_type;
-    int bit_depth, interlace_type, compression_type;
-    int i;
-
-    png_unknown_chunk unknowns[3];
-    unknowns[0].data = NULL;
-    unknowns[1].data = NULL;
-    unknowns[2].data = NULL;
-
-    png_bytepp outRows = (png_bytepp)malloc((int)imageInfo.height * sizeof(png_bytep));
-    if (outRows == (png_bytepp)0)
+    switch (analysis.colorType)
     {
-        printf("Can't allocate output buffer!\n");
-        exit(1);
-    }
-    for (i = 0; i < (int)imageInfo.height; i++)
+    case PNG_COLOR_TYPE_PALETTE:
     {
-        outRows[i] = (png_bytep)malloc(2 * (int)imageInfo.width);
-        if (outRows[i] == (png_bytep)0)
+        uint32_t lastCol = 0;
+        int lastIdx = -1;
+        png_bytep p = row;
+        for (int i = 0; i < width; i++, p += 4)
         {
-            printf("Can't allocate output buffer!\n");
-            exit(1);
+            uint32_t col = (uint32_t)((p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+            if (col != lastCol || lastIdx < 0)
+            {
+                lastCol = col;
+                lastIdx = analysis.colorTable.find(col);
+            }
+            out[i] = (png_byte)lastIdx;
         }
+        return out;
     }
-
-    png_set_compression_level(write_ptr, Z_BEST_COMPRESSION);
-
-    if (IS_DEBUG)
-    {
-        printf("Writing image %s: w = %d, h = %d\n", imageName,
-               (int)imageInfo.width, (int)imageInfo.height);
+    case PNG_COLOR_TYPE_GRAY:
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        // Gray or gray + alpha, compact the pixels
+        compact_gray_row(row, width, out, !analysis.isGrayscale, !analysis.isOpaque);
+        return out;
+    default:
+        // RGB(A) rows are written as they are, RGB drops the alpha byte via png_set_filler
+        return row;
     }
+}
 
-    png_color rgbPalette[256];
-    png_byte alphaPalette[256];
-    bool hasTransparency;
-    int paletteEntries;
+void prepare_write(const char *imageName, image_info &imageInfo, const Bundle *bundle,
+                   image_analysis *analysis)
+{
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Writing image %s: w = %d, h = %d\n", imageName,
+                 (int)imageInfo.width, (int)imageInfo.height);
 
     int grayscaleTolerance = bundle ? bundle->grayscaleTolerance : 0;
-    analyze_image(imageName, imageInfo, grayscaleTolerance, rgbPalette, alphaPalette,
-                  &paletteEntries, &hasTransparency, &color_type, outRows);
+    analyze_image(imageName, imageInfo, grayscaleTolerance, analysis);
+    int color_type = analysis->colorType;
+    bool hasTransparency = analysis->hasTransparency;
 
     // If the image is a 9-patch, we need to preserve it as a ARGB file to make
     // sure the pixels will not be pre-dithered/clamped until we decide they are
@@ -1252,30 +1405,139 @@ void write_png(const char *imageName,
             }
         }
     }
+    analysis->colorType = color_type;
 
-    if (IS_DEBUG)
+    if (AAPT9PNG_LOG_ENABLED(AAPT9PNG_LOG_DEBUG))
     {
         switch (color_type)
         {
         case PNG_COLOR_TYPE_PALETTE:
-            printf("Image %s has %d colors%s, using PNG_COLOR_TYPE_PALETTE\n",
-                   imageName, paletteEntries,
-                   hasTransparency ? " (with alpha)" : "");
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Image %s has %d colors%s, using PNG_COLOR_TYPE_PALETTE\n",
+                        imageName, analysis->paletteEntries,
+                        hasTransparency ? " (with alpha)" : "");
             break;
         case PNG_COLOR_TYPE_GRAY:
-            printf("Image %s is opaque gray, using PNG_COLOR_TYPE_GRAY\n", imageName);
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Image %s is opaque gray, using PNG_COLOR_TYPE_GRAY\n", imageName);
             break;
         case PNG_COLOR_TYPE_GRAY_ALPHA:
-            printf("Image %s is gray + alpha, using PNG_COLOR_TYPE_GRAY_ALPHA\n", imageName);
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Image %s is gray + alpha, using PNG_COLOR_TYPE_GRAY_ALPHA\n", imageName);
             break;
         case PNG_COLOR_TYPE_RGB:
-            printf("Image %s is opaque RGB, using PNG_COLOR_TYPE_RGB\n", imageName);
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Image %s is opaque RGB, using PNG_COLOR_TYPE_RGB\n", imageName);
             break;
         case PNG_COLOR_TYPE_RGB_ALPHA:
-            printf("Image %s is RGB + alpha, using PNG_COLOR_TYPE_RGB_ALPHA\n", imageName);
+            Aapt9PNGLog(AAPT9PNG_LOG_DEBUG, "Image %s is RGB + alpha, using PNG_COLOR_TYPE_RGB_ALPHA\n", imageName);
             break;
         }
     }
+}
+
+int make_9patch_chunks(image_info &imageInfo, png_unknown_chunk unknowns[3])
+{
+    int chunk_count = 2 + (imageInfo.haveLayoutBounds ? 1 : 0);
+    int p_index = imageInfo.haveLayoutBounds ? 2 : 1;
+    int b_index = 1;
+    int o_index = 0;
+
+    // base 9 patch data
+    AAPT9PNG_LOG(AAPT9PNG_LOG_VERBOSE, "Adding 9-patch info...\n");
+    strcpy((char *)unknowns[p_index].name, "npTc");
+    unknowns[p_index].data = (png_byte *)imageInfo.serialize9patch();
+    unknowns[p_index].size = imageInfo.info9Patch.serializedSize();
+    // TODO: remove the check below when everything works
+    checkNinePatchSerialization(&imageInfo, unknowns[p_index].data);
+
+    // automatically generated 9 patch outline data
+    int chunk_size = sizeof(png_uint_32) * 6;
+    strcpy((char *)unknowns[o_index].name, "npOl");
+    unknowns[o_index].data = (png_byte *)calloc(chunk_size, 1);
+    png_byte outputData[chunk_size];
+    memcpy(&outputData, &imageInfo.outlineInsetsLeft, 4 * sizeof(png_uint_32));
+    ((float *)outputData)[4] = imageInfo.outlineRadius;
+    ((png_uint_32 *)outputData)[5] = imageInfo.outlineAlpha;
+    memcpy(unknowns[o_index].data, &outputData, chunk_size);
+    unknowns[o_index].size = chunk_size;
+
+    // optional optical inset / layout bounds data
+    if (imageInfo.haveLayoutBounds)
+    {
+        int chunk_size = sizeof(png_uint_32) * 4;
+        strcpy((char *)unknowns[b_index].name, "npLb");
+        unknowns[b_index].data = (png_byte *)calloc(chunk_size, 1);
+        memcpy(unknowns[b_index].data, &imageInfo.layoutBoundsLeft, chunk_size);
+        unknowns[b_index].size = chunk_size;
+    }
+
+    return chunk_count;
+}
+
+png_compression compression_for_profile(int profile, int colorType)
+{
+    png_compression compression;
+    compression.strategy = -1;
+    switch (profile)
+    {
+    case COMPRESSION_FAST:
+        compression.level = 1;
+        compression.filters = colorType == PNG_COLOR_TYPE_PALETTE ? PNG_NO_FILTERS : PNG_FILTER_SUB;
+        break;
+    case COMPRESSION_DEFAULT:
+        compression.level = Z_DEFAULT_COMPRESSION;
+        compression.filters = colorType == PNG_COLOR_TYPE_PALETTE ? PNG_NO_FILTERS : PNG_ALL_FILTERS;
+        break;
+    default:
+        compression.level = Z_BEST_COMPRESSION;
+        compression.filters = colorType == PNG_COLOR_TYPE_PALETTE ? PNG_NO_FILTERS : PNG_ALL_FILTERS;
+        break;
+    }
+    return compression;
+}
+
+void write_png(const char *imageName,
+               png_structp write_ptr, png_infop write_info,
+               image_info &imageInfo, const Bundle *bundle, png_row_buffers *buffers)
+{
+    image_analysis analysis;
+    prepare_write(imageName, imageInfo, bundle, &analysis);
+
+    int profile = bundle ? bundle->compressionProfile : COMPRESSION_BEST;
+    encode_png(imageName, write_ptr, write_info, imageInfo, analysis,
+               compression_for_profile(profile, analysis.colorType), imageInfo.error, buffers);
+}
+
+void encode_png(const char *imageName,
+                png_structp write_ptr, png_infop write_info,
+                image_info &imageInfo, const image_analysis &analysis,
+                const png_compression &compression, Aapt9PNGError *error, png_row_buffers *buffers)
+{
+    png_uint_32 width, height;
+    int color_type = analysis.colorType;
+    int bit_depth, interlace_type, compression_type;
+    png_colorp rgbPalette = const_cast<png_colorp>(analysis.rgbPalette);
+    png_bytep alphaPalette = const_cast<png_bytep>(analysis.alphaPalette);
+    bool hasTransparency = analysis.hasTransparency;
+    int paletteEntries = analysis.paletteEntries;
+
+    // Chunks left over from an encode that png_error cut short are freed here.
+    png_unknown_chunk *unknowns = buffers->chunks;
+    buffers->free_chunks();
+
+    // Rows are converted one at a time into this scratch row and streamed
+    // to libpng, so only the source image is held in memory. The parallel
+    // trials of write_png_smallest share imageInfo, so each passes its own
+    // buffers and reports into its own error rather than imageInfo.error.
+    png_bytep outRow = buffers->alloc_scratch(2 * imageInfo.width);
+    if (outRow == (png_bytep)0)
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_NO_MEMORY, "Can't allocate output buffer");
+        png_error(write_ptr, "Can't allocate output buffer");
+    }
+
+    png_set_compression_level(write_ptr, compression.level);
+    if (compression.strategy >= 0)
+    {
+        png_set_compression_strategy(write_ptr, compression.strategy);
+    }
 
     png_set_IHDR(write_ptr, write_info, imageInfo.width, imageInfo.height,
                  8, color_type, PNG_INTERLACE_NONE,
@@ -1288,57 +1550,18 @@ void write_png(const char *imageName,
         {
             png_set_tRNS(write_ptr, write_info, alphaPalette, paletteEntries, (png_color_16p)0);
         }
-        png_set_filter(write_ptr, 0, PNG_NO_FILTERS);
-    }
-    else
-    {
-        png_set_filter(write_ptr, 0, PNG_ALL_FILTERS);
     }
+    png_set_filter(write_ptr, 0, compression.filters);
 
     if (imageInfo.is9Patch)
     {
-        int chunk_count = 2 + (imageInfo.haveLayoutBounds ? 1 : 0);
-        int p_index = imageInfo.haveLayoutBounds ? 2 : 1;
-        int b_index = 1;
-        int o_index = 0;
+        int chunk_count = make_9patch_chunks(imageInfo, unknowns);
 
         // Chunks ordered thusly because older platforms depend on the base 9 patch data being last
         png_byte *chunk_names = imageInfo.haveLayoutBounds
                                     ? (png_byte *)"npOl\0npLb\0npTc\0"
                                     : (png_byte *)"npOl\0npTc";
 
-        // base 9 patch data
-        if (IS_DEBUG)
-        {
-            printf("Adding 9-patch info...\n");
-        }
-        strcpy((char *)unknowns[p_index].name, "npTc");
-        unknowns[p_index].data = (png_byte *)imageInfo.serialize9patch();
-        unknowns[p_index].size = imageInfo.info9Patch.serializedSize();
-        // TODO: remove the check below when everything works
-        checkNinePatchSerialization(&imageInfo.info9Patch, unknowns[p_index].data);
-
-        // automatically generated 9 patch outline data
-        int chunk_size = sizeof(png_uint_32) * 6;
-        strcpy((char *)unknowns[o_index].name, "npOl");
-        unknowns[o_index].data = (png_byte *)calloc(chunk_size, 1);
-        png_byte outputData[chunk_size];
-        memcpy(&outputData, &imageInfo.outlineInsetsLeft, 4 * sizeof(png_uint_32));
-        ((float *)outputData)[4] = imageInfo.outlineRadius;
-        ((png_uint_32 *)outputData)[5] = imageInfo.outlineAlpha;
-        memcpy(unknowns[o_index].data, &outputData, chunk_size);
-        unknowns[o_index].size = chunk_size;
-
-        // optional optical inset / layout bounds data
-        if (imageInfo.haveLayoutBounds)
-        {
-            int chunk_size = sizeof(png_uint_32) * 4;
-            strcpy((char *)unknowns[b_index].name, "npLb");
-            unknowns[b_index].data = (png_byte *)calloc(chunk_size, 1);
-            memcpy(unknowns[b_index].data, &imageInfo.layoutBoundsLeft, chunk_size);
-            unknowns[b_index].size = chunk_size;
-        }
-
         for (int i = 0; i < chunk_count; i++)
         {
             unknowns[i].location = PNG_HAVE_PLTE;
@@ -1358,108 +1581,467 @@ void write_png(const char *imageName,
 
     png_write_info(write_ptr, write_info);
 
-    png_bytepp rows;
-    if (color_type == PNG_COLOR_TYPE_RGB || color_type == PNG_COLOR_TYPE_RGB_ALPHA)
+    if (color_type == PNG_COLOR_TYPE_RGB)
     {
-        if (color_type == PNG_COLOR_TYPE_RGB)
-        {
-            png_set_filler(write_ptr, 0, PNG_FILLER_AFTER);
-        }
-        rows = imageInfo.rows;
+        png_set_filler(write_ptr, 0, PNG_FILLER_AFTER);
     }
-    else
+    for (png_uint_32 j = 0; j < imageInfo.height; j++)
     {
-        rows = outRows;
+        png_write_row(write_ptr, convert_row(analysis, imageInfo.rows[j], imageInfo.width, outRow));
     }
-    png_write_image(write_ptr, rows);
 
     //     NOISY(printf("Final image data:\n"));
     //     dump_image(imageInfo.width, imageInfo.height, rows, color_type);
 
     png_write_end(write_ptr, write_info);
 
-    for (i = 0; i < (int)imageInfo.height; i++)
-    {
-        free(outRows[i]);
-    }
-    free(outRows);
-    free(unknowns[0].data);
-    free(unknowns[1].data);
-    free(unknowns[2].data);
+    buffers->free_chunks();
 
     png_get_IHDR(write_ptr, write_info, &width, &height,
                  &bit_depth, &color_type, &interlace_type,
                  &compression_type, NULL);
 
-    if (IS_DEBUG)
-    {
-        printf("Image written: w=%d, h=%d, d=%d, colors=%d, inter=%d, comp=%d\n",
-               (int)width, (int)height, bit_depth, color_type, interlace_type,
-               compression_type);
-    }
+    AAPT9PNG_LOG(AAPT9PNG_LOG_DEBUG, "Image %s written: w=%d, h=%d, d=%d, colors=%d, inter=%d, comp=%d\n",
+                 imageName, (int)width, (int)height, bit_depth, color_type, interlace_type,
+                 compression_type);
 }
 
-static int read_9patched_chunks(png_structp read_ptr, png_unknown_chunkp chunk)
+int parse_9patch_chunk(image_info *image, const char *name, const png_byte *data, size_t size)
 {
-    image_info *image = (image_info *)png_get_user_chunk_ptr(read_ptr);
-    if (strcmp((char const *)chunk->name, "npOl") == 0)
+    if (strcmp(name, "npOl") == 0)
     {
-        memcpy(&image->outlineInsetsLeft, chunk->data, 4 * sizeof(png_uint_32));
-        image->outlineRadius = ((float *)chunk->data)[4];
-        image->outlineAlpha = ((png_uint_32 *)chunk->data)[5];
+        if (size < 6 * sizeof(png_uint_32))
+        {
+            return -1;
+        }
+        memcpy(&image->outlineInsetsLeft, data, 4 * sizeof(png_uint_32));
+        memcpy(&image->outlineRadius, data + 4 * sizeof(png_uint_32), sizeof(float));
+        png_uint_32 alpha;
+        memcpy(&alpha, data + 5 * sizeof(png_uint_32), sizeof(png_uint_32));
+        image->outlineAlpha = alpha;
         return 1;
     }
-    else if (strcmp((char const *)chunk->name, "npTc") == 0)
+    else if (strcmp(name, "npLb") == 0)
     {
-        image->is9Patch = true;
-        image->haveLayoutBounds = false;
+        if (size < 4 * sizeof(png_uint_32))
+        {
+            return -1;
+        }
+        image->haveLayoutBounds = true;
+        memcpy(&image->layoutBoundsLeft, data, 4 * sizeof(png_uint_32));
+        return 1;
+    }
+    else if (strcmp(name, "npTc") == 0)
+    {
+        // The header is 32 bytes, followed by numXDivs + numYDivs + numColors words
+        if (size < 32 || size < 32 + 4 * ((size_t)data[1] + data[2] + data[3]))
+        {
+            return -1;
+        }
 
-        auto patch = Res_png_9patch::deserialize((void *)chunk->data);
+        // Deserializing works in place, on a copy since |data| may be read-only
+        void *copy = malloc(size);
+        memcpy(copy, data, size);
+        auto patch = Res_png_9patch::deserialize(copy);
         patch->fileToDevice();
+
+        image->is9Patch = true;
         memcpy(&image->info9Patch, patch, sizeof(Res_png_9patch));
 
+        free(image->xDivs);
         image->xDivs = (int32_t *)malloc(patch->numXDivs * sizeof(int32_t));
         memcpy(image->xDivs, patch->getXDivs(), patch->numXDivs * sizeof(int32_t));
 
+        free(image->yDivs);
         image->yDivs = (int32_t *)malloc(patch->numYDivs * sizeof(int32_t));
         memcpy(image->yDivs, patch->getYDivs(), patch->numYDivs * sizeof(int32_t));
 
+        free(image->colors);
         image->colors = (uint32_t *)malloc(patch->numColors * sizeof(uint32_t));
         memcpy(image->colors, patch->getColors(), patch->numColors * sizeof(uint32_t));
 
+        free(copy);
         return 1;
     }
     return 0;
 }
 
-bool read_png_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
-                        String8 const &file, FILE *fp, image_info *imageInfo)
+static int read_9patched_chunks(png_structp read_ptr, png_unknown_chunkp chunk)
 {
-    if (setjmp(png_jmpbuf(read_ptr)))
+    image_info *image = (image_info *)png_get_user_chunk_ptr(read_ptr);
+    return parse_9patch_chunk(image, (char const *)chunk->name, chunk->data, chunk->size);
+}
+
+static png_uint_32 read_be32(const png_byte *p)
+{
+    return ((png_uint_32)p[0] << 24) | ((png_uint_32)p[1] << 16) | ((png_uint_32)p[2] << 8) | p[3];
+}
+
+bool read_9patch_chunks_only(const png_byte *data, size_t size, image_info *imageInfo)
+{
+    static const png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 8 || memcmp(data, signature, 8) != 0)
     {
         return false;
     }
 
-    png_init_io(read_ptr, fp);
+    bool haveHeader = false;
+    size_t offset = 8;
+    while (offset + 12 <= size)
+    {
+        png_uint_32 length = read_be32(data + offset);
+        if (length > size - offset - 12)
+        {
+            return false;
+        }
+
+        char name[5];
+        memcpy(name, data + offset + 4, 4);
+        name[4] = '\0';
+        const png_byte *body = data + offset + 8;
+
+        // Pixels start at the first IDAT; nothing after it is needed here
+        if (strcmp(name, "IDAT") == 0 || strcmp(name, "IEND") == 0)
+        {
+            return haveHeader;
+        }
+
+        bool isHeader = strcmp(name, "IHDR") == 0;
+        if (isHeader || (name[0] == 'n' && name[1] == 'p'))
+        {
+            png_uint_32 crc = crc32(0, data + offset + 4, length + 4);
+            if (crc != read_be32(body + length))
+            {
+                return false;
+            }
+        }
+
+        if (isHeader)
+        {
+            if (length < 8)
+            {
+                return false;
+            }
+            imageInfo->width = read_be32(body);
+            imageInfo->height = read_be32(body + 4);
+            haveHeader = true;
+        }
+        else if (parse_9patch_chunk(imageInfo, name, body, length) < 0)
+        {
+            return false;
+        }
 
+        offset += 12 + length;
+    }
+    return false;
+}
+
+static void append_be32(::std::vector<png_byte> *out, png_uint_32 value)
+{
+    png_byte bytes[4] = {(png_byte)(value >> 24), (png_byte)(value >> 16), (png_byte)(value >> 8), (png_byte)value};
+    out->insert(out->end(), bytes, bytes + 4);
+}
+
+static void append_chunk(::std::vector<png_byte> *out, const png_byte *name, const png_byte *data, size_t size)
+{
+    append_be32(out, (png_uint_32)size);
+    size_t start = out->size();
+    out->insert(out->end(), name, name + 4);
+    out->insert(out->end(), data, data + size);
+    append_be32(out, crc32(0, out->data() + start, size + 4));
+}
+
+bool rewrite_9patch_chunks(const png_byte *data, size_t size, image_info &imageInfo,
+                           ::std::vector<png_byte> *out)
+{
+    static const png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < 8 || memcmp(data, signature, 8) != 0)
+    {
+        return false;
+    }
+
+    png_unknown_chunk unknowns[3];
+    int chunk_count = make_9patch_chunks(imageInfo, unknowns);
+
+    out->clear();
+    out->reserve(size + 256);
+    out->insert(out->end(), signature, signature + 8);
+
+    bool inserted = false;
+    bool ended = false;
+    size_t offset = 8;
+    while (offset + 12 <= size && !ended)
+    {
+        png_uint_32 length = read_be32(data + offset);
+        if (length > size - offset - 12)
+        {
+            break;
+        }
+        const png_byte *name = data + offset + 4;
+
+        // New 9-patch chunks go where libpng puts them, right before the pixels
+        if (!inserted && memcmp(name, "IDAT", 4) == 0)
+        {
+            for (int i = 0; i < chunk_count; i++)
+            {
+                append_chunk(out, unknowns[i].name, unknowns[i].data, unknowns[i].size);
+            }
+            inserted = true;
+        }
+
+        // Everything except the old 9-patch chunks is copied with its CRC
+        if (memcmp(name, "npTc", 4) != 0 && memcmp(name, "npOl", 4) != 0 && memcmp(name, "npLb", 4) != 0)
+        {
+            out->insert(out->end(), data + offset, data + offset + 12 + length);
+        }
+
+        ended = memcmp(name, "IEND", 4) == 0;
+        offset += 12 + length;
+    }
+
+    for (int i = 0; i < chunk_count; i++)
+    {
+        free(unknowns[i].data);
+    }
+    return inserted && ended;
+}
+
+static bool is_9patch_name(String8 const &file)
+{
     const size_t nameLen = file.length();
     if (nameLen > 6)
     {
         const char *name = file.c_str();
         if (name[nameLen - 5] == '9' && name[nameLen - 6] == '.')
         {
-            /* if (do_9patch(printableName.c_str(), imageInfo) != NO_ERROR)
-            {
-                return false;
-            }
-            */
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_png_setup_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
+                                     int ninePatch, image_info *imageInfo)
+{
+    if (!read_ptr || !read_info)
+    {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't create png read struct");
+        return false;
+    }
+    if (setjmp(png_jmpbuf(read_ptr)))
+    {
+        return false;
+    }
+
+    if (ninePatch == NINE_PATCH_CHUNKS)
+    {
+        // 从png文件中读取处理过的.9信息
+        png_set_read_user_chunk_fn(read_ptr, imageInfo, read_9patched_chunks);
+    }
 
-            // 从png文件中读取处理过的.9信息
-            png_set_read_user_chunk_fn(read_ptr, imageInfo, read_9patched_chunks);
+    read_png(printableName.c_str(), read_ptr, read_info, imageInfo, ninePatch == NINE_PATCH_SOURCE);
+
+    if (ninePatch == NINE_PATCH_SOURCE)
+    {
+        // 原始.9.png, 从边框计算.9信息并去掉边框
+        if (do_9patch(printableName.c_str(), imageInfo) != NO_ERROR)
+        {
+            return false;
         }
     }
 
-    read_png(printableName.c_str(), read_ptr, read_info, imageInfo);
+    return true;
+}
+
+bool read_png_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
+                        String8 const &file, FILE *fp, image_info *imageInfo)
+{
+    png_init_io(read_ptr, fp);
+
+    return read_png_setup_protected(read_ptr, printableName, read_info,
+                                    is_9patch_name(file) ? NINE_PATCH_CHUNKS : NINE_PATCH_NONE, imageInfo);
+}
+
+// libpng read callback feeding from a png_memory_source
+static void read_from_buffer(png_structp read_ptr, png_bytep data, png_size_t length)
+{
+    png_memory_source *source = (png_memory_source *)png_get_io_ptr(read_ptr);
+    if (length > source->size - source->offset)
+    {
+        png_error(read_ptr, "Read past end of data");
+    }
+    memcpy(data, source->data + source->offset, length);
+    source->offset += length;
+}
+
+bool read_png_buffer_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
+                               png_memory_source *source, int ninePatch, image_info *imageInfo)
+{
+    png_set_read_fn(read_ptr, source, read_from_buffer);
+
+    return read_png_setup_protected(read_ptr, printableName, read_info, ninePatch, imageInfo);
+}
+
+// libpng write callbacks collecting the encoded file in memory
+static void write_to_buffer(png_structp write_ptr, png_bytep data, png_size_t length)
+{
+    ::std::vector<png_byte> *buffer = (::std::vector<png_byte> *)png_get_io_ptr(write_ptr);
+    buffer->insert(buffer->end(), data, data + length);
+}
+
+static void flush_buffer(png_structp)
+{
+}
+
+static bool encode_png_to_buffer(const char *imageName, image_info &imageInfo,
+                                 const image_analysis &analysis, const png_compression &compression,
+                                 ::std::vector<png_byte> *out, Aapt9PNGError *error)
+{
+    // Trials run concurrently, so each reports into its own error; the caller
+    // forwards one result to imageInfo.error after all trials have joined.
+    png_structp write_ptr = create_write_struct(error);
+    png_infop write_info = png_create_info_struct(write_ptr);
+    if (!write_ptr || !write_info)
+    {
+        SetAapt9PNGError(error, AAPT9PNG_ERROR_NO_MEMORY, "Can't create png write struct");
+        png_destroy_write_struct(&write_ptr, &write_info);
+        return false;
+    }
+
+    // Owned by this frame so a png_error longjmp back here still frees them
+    png_row_buffers buffers;
+    if (setjmp(png_jmpbuf(write_ptr)))
+    {
+        png_destroy_write_struct(&write_ptr, &write_info);
+        return false;
+    }
+
+    png_set_write_fn(write_ptr, out, write_to_buffer, flush_buffer);
+    encode_png(imageName, write_ptr, write_info, imageInfo, analysis, compression, error, &buffers);
+
+    png_destroy_write_struct(&write_ptr, &write_info);
+    return true;
+}
+
+bool write_png_smallest(const char *imageName, image_info &imageInfo, const Bundle *bundle,
+                        ::std::vector<png_byte> *out)
+{
+    image_analysis analysis;
+    prepare_write(imageName, imageInfo, bundle, &analysis);
+
+    // The first trial is the COMPRESSION_BEST encoding, so ties keep its output.
+    png_compression trials[] = {
+        compression_for_profile(COMPRESSION_BEST, analysis.colorType),
+        {Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, PNG_ALL_FILTERS},
+        {Z_BEST_COMPRESSION, Z_RLE, PNG_ALL_FILTERS},
+        {Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, PNG_FILTER_NONE},
+        {Z_BEST_COMPRESSION, Z_FILTERED, PNG_FILTER_SUB},
+        {Z_BEST_COMPRESSION, Z_FILTERED, PNG_FILTER_PAETH},
+        {Z_BEST_COMPRESSION, Z_RLE, PNG_FILTER_NONE},
+        {Z_BEST_COMPRESSION, Z_RLE, PNG_FILTER_SUB},
+    };
+
+    // Every trial reads the same analysis and source rows and writes its own
+    // buffer, so they run side by side on a small thread pool.
+    const size_t numTrials = sizeof(trials) / sizeof(trials[0]);
+    ::std::vector<png_byte> encoded[numTrials];
+    Aapt9PNGError errors[numTrials];
+    bool succeeded[numTrials];
+    ::std::atomic<size_t> next(0);
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < numTrials)
+        {
+            succeeded[i] = encode_png_to_buffer(imageName, imageInfo, analysis, trials[i], &encoded[i], &errors[i]);
+        }
+    };
+
+    size_t threads = bundle && bundle->trialThreads > 0 ? (size_t)bundle->trialThreads
+                                                        : ::std::max(1u, ::std::thread::hardware_concurrency());
+    threads = ::std::min(threads, numTrials);
+    ::std::vector<::std::thread> pool;
+    for (size_t i = 1; i < threads; i++)
+    {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto &th : pool)
+    {
+        th.join();
+    }
+
+    size_t winner = numTrials;
+    for (size_t i = 0; i < numTrials; i++)
+    {
+        if (!succeeded[i])
+        {
+            continue;
+        }
+        AAPT9PNG_LOG(AAPT9PNG_LOG_VERBOSE, "Trial %d (strategy %d, filters 0x%x): %d bytes\n",
+                     (int)i, trials[i].strategy, trials[i].filters, (int)encoded[i].size());
+        if (winner == numTrials || encoded[i].size() < out->size())
+        {
+            out->swap(encoded[i]);
+            winner = i;
+        }
+    }
+
+    // Only now, with every trial joined, is the shared imageInfo.error touched:
+    // the winner's warnings, or the first trial's failure.
+    if (winner == numTrials)
+    {
+        const Aapt9PNGError &failed = errors[0];
+        if (failed.code != AAPT9PNG_OK)
+        {
+            SetAapt9PNGError(imageInfo.error, failed.code, failed.message);
+        }
+        SetAapt9PNGError(imageInfo.error, AAPT9PNG_ERROR_PNG, "All compression trials failed");
+        return false;
+    }
+    for (const auto &warning : errors[winner].warnings)
+    {
+        AddAapt9PNGWarning(imageInfo.error, warning);
+    }
+    return true;
+}
+
+static bool write_file_protected(String8 const &path, const ::std::vector<png_byte> &data, image_info *imageInfo)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    bool written = fp && fwrite(data.data(), 1, data.size(), fp) == data.size();
+    if (!(fp && fclose(fp) == 0 && written))
+    {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_IO, "Can't write " + path);
+        return false;
+    }
+    return true;
+}
+
+bool write_png_buffer_protected(png_structp write_ptr, String8 const &printableName, png_infop write_info,
+                                image_info *imageInfo, Bundle const *bundle, ::std::vector<png_byte> *out)
+{
+    if (!write_ptr || !write_info)
+    {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't create png write struct");
+        return false;
+    }
+    if (bundle && bundle->compressionProfile == COMPRESSION_MAX)
+    {
+        return write_png_smallest(printableName.c_str(), *imageInfo, bundle, out);
+    }
+
+    // Images read without context buffers use these, freed even after a longjmp
+    png_row_buffers local;
+    if (setjmp(png_jmpbuf(write_ptr)))
+    {
+        return false;
+    }
+
+    png_set_write_fn(write_ptr, out, write_to_buffer, flush_buffer);
+
+    write_png(printableName.c_str(), write_ptr, write_info, *imageInfo, bundle,
+              imageInfo->buffers ? imageInfo->buffers : &local);
 
     return true;
 }
@@ -1467,16 +2049,42 @@ bool read_png_protected(png_structp read_ptr, String8 const &printableName, png_
 bool write_png_protected(png_structp write_ptr, String8 const &printableName, png_infop write_info,
                          image_info *imageInfo, Bundle const *bundle)
 {
-    if (setjmp(png_jmpbuf(write_ptr)))
+    if (!write_ptr || !write_info)
     {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_NO_MEMORY, "Can't create png write struct");
         return false;
     }
+    if (bundle && bundle->compressionProfile == COMPRESSION_MAX)
+    {
+        ::std::vector<png_byte> encoded;
+        return write_png_smallest(printableName.c_str(), *imageInfo, bundle, &encoded) &&
+               write_file_protected(printableName, encoded, imageInfo);
+    }
 
     FILE *fp = fopen(printableName.c_str(), "wb");
+    if (!fp)
+    {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_IO, "Can't write " + printableName);
+        return false;
+    }
+
+    // Images read without context buffers use these, freed even after a longjmp
+    png_row_buffers local;
+    if (setjmp(png_jmpbuf(write_ptr)))
+    {
+        fclose(fp);
+        return false;
+    }
+
     png_init_io(write_ptr, fp);
 
-    write_png(printableName.c_str(), write_ptr, write_info, *imageInfo, bundle);
+    write_png(printableName.c_str(), write_ptr, write_info, *imageInfo, bundle,
+              imageInfo->buffers ? imageInfo->buffers : &local);
 
-    fclose(fp);
+    if (fclose(fp) != 0)
+    {
+        SetAapt9PNGError(imageInfo->error, AAPT9PNG_ERROR_IO, "Can't write " + printableName);
+        return false;
+    }
     return true;
 }
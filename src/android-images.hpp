@@ -2,7 +2,10 @@
 #define __ANDROID_IMAGES_H_INCLUDED
 
 #include "android-platform.hpp"
+#include "9png-error.hpp"
 #include <string>
+#include <vector>
+#include <string.h>
 
 //#define PNG_INTERNAL
 #include <png.h>
@@ -10,11 +13,66 @@
 typedef ::std::string String8;
 class Bundle;
 
+// Row storage that outlives a single image, so a thread processing many
+// images reuses the same allocations. Buffers only ever grow.
+struct png_row_buffers
+{
+    png_row_buffers() : pixels(NULL), pixelsCapacity(0), rows(NULL), rowsCapacity(0),
+                        scratch(NULL), scratchCapacity(0), columns(NULL), columnsCapacity(0),
+                        alpha(NULL), alphaCapacity(0)
+    {
+        chunks[0].data = chunks[1].data = chunks[2].data = NULL;
+    }
+
+    ~png_row_buffers();
+
+    // Same contract as alloc_row_slab, but the memory stays owned by this object.
+    png_bytep alloc_pixels(png_uint_32 height, size_t rowBytes, size_t *outStride, png_bytepp *outRows);
+
+    png_bytep alloc_scratch(size_t size);
+
+    uint32_t *alloc_columns(size_t count);
+
+    png_bytep alloc_alpha(size_t size);
+
+    // Frees the chunk data left by make_9patch_chunks.
+    void free_chunks();
+
+    png_bytep pixels;
+    size_t pixelsCapacity;
+    png_bytepp rows;
+    png_uint_32 rowsCapacity;
+    png_bytep scratch;
+    size_t scratchCapacity;
+    uint32_t *columns;
+    size_t columnsCapacity;
+    png_bytep alpha;
+    size_t alphaCapacity;
+
+    // npOl/npLb/npTc written by encode_png. They are held here rather than
+    // on encode_png's stack so a png_error longjmp past it does not leak them.
+    png_unknown_chunk chunks[3];
+};
+
+// Columns of a source 9-patch gathered by read_png, each allocHeight pixels long
+enum
+{
+    COLUMN_LEFT,   // x = 0, the left edge of the frame
+    COLUMN_RIGHT,  // x = width - 1, the right edge of the frame
+    COLUMN_CENTER, // x = width / 2, scanned by get_outline
+    COLUMN_COUNT
+};
+
 // This holds an image as 8bpp RGBA.
 struct image_info
 {
-    image_info() : rows(NULL), is9Patch(false),
-                   xDivs(NULL), yDivs(NULL), colors(NULL), allocRows(NULL) {}
+    image_info() : width(0), height(0), rows(NULL), is9Patch(false),
+                   xDivs(NULL), yDivs(NULL), colors(NULL), haveLayoutBounds(false),
+                   layoutBoundsLeft(0), layoutBoundsTop(0), layoutBoundsRight(0), layoutBoundsBottom(0),
+                   outlineInsetsLeft(0), outlineInsetsTop(0), outlineInsetsRight(0), outlineInsetsBottom(0),
+                   outlineRadius(0), outlineAlpha(0), allocHeight(0), allocRows(NULL),
+                   pixels(NULL), stride(0), columns(NULL), alpha(NULL), alphaBase(NULL), alphaStride(0),
+                   buffers(NULL), error(NULL) {}
 
     ~image_info();
 
@@ -27,6 +85,7 @@ struct image_info
 
     png_uint_32 width;
     png_uint_32 height;
+    // Points into allocRows and is never freed on its own
     png_bytepp rows;
 
     // 9-patch info.
@@ -53,11 +112,120 @@ struct image_info
 
     png_uint_32 allocHeight;
     png_bytepp allocRows;
+
+    // All rows live in one aligned slab; allocRows[i] == pixels + i * stride.
+    // do_9patch strips the frame in place: rows becomes allocRows + 1 and
+    // allocRows[1 .. allocHeight - 2] move one pixel right.
+    png_bytep pixels;
+    size_t stride;
+
+    // COLUMN_COUNT columns of allocHeight pixels as 0xAABBGGRR, column c
+    // starting at columns + c * allocHeight. NULL unless gathered.
+    uint32_t *columns;
+
+    // Alpha of every pixel, alphaStride bytes per row. Like rows it starts
+    // at the top-left pixel of the image, so do_9patch moves it past the
+    // frame. alphaBase is the allocation. NULL unless gathered.
+    png_bytep alpha;
+    png_bytep alphaBase;
+    size_t alphaStride;
+
+    // When set, allocRows/pixels are borrowed from here and not freed.
+    png_row_buffers *buffers;
+
+    // Errors and libpng warnings for this image are reported here (may be NULL).
+    Aapt9PNGError *error;
 };
 
+/**
+ * @brief 分配 height 行连续且对齐的像素, rows 指向其中各行
+ */
+extern png_bytep alloc_row_slab(png_uint_32 height, size_t rowBytes,
+                                size_t *outStride, png_bytepp *outRows);
+
+// Open-addressing map from RGBA color to palette index, sized for at most
+// 256 entries at a load factor of 1/2.
+struct color_table
+{
+    enum
+    {
+        SLOTS = 512
+    };
+
+    color_table()
+    {
+        memset(index, 0, sizeof(index));
+    }
+
+    static int slot(uint32_t col)
+    {
+        return (int)((col * 0x9E3779B1u) >> 23);
+    }
+
+    int find(uint32_t col) const
+    {
+        for (int s = slot(col);; s = (s + 1) & (SLOTS - 1))
+        {
+            if (index[s] == 0)
+            {
+                return -1;
+            }
+            if (keys[s] == col)
+            {
+                return index[s] - 1;
+            }
+        }
+    }
+
+    void insert(uint32_t col, int idx)
+    {
+        int s = slot(col);
+        while (index[s] != 0)
+        {
+            s = (s + 1) & (SLOTS - 1);
+        }
+        keys[s] = col;
+        index[s] = (uint16_t)(idx + 1);
+    }
+
+    uint32_t keys[SLOTS];
+    uint16_t index[SLOTS]; // palette index + 1, 0 marks an empty slot
+};
+
+// What analyze_image decided for an image, and what is needed to convert
+// its rows into that color type.
+struct image_analysis
+{
+    int colorType;
+    bool isGrayscale;
+    bool isOpaque;
+    bool hasTransparency;
+
+    int paletteEntries;
+    png_color rgbPalette[256];
+    png_byte alphaPalette[256];
+    color_table colorTable;
+};
+
+/**
+ * @brief 创建 libpng 读写结构, 错误与警告记录到 error (可为空), 不输出到 stderr
+ */
+extern png_structp create_read_struct(Aapt9PNGError *error);
+extern png_structp create_write_struct(Aapt9PNGError *error);
+
+/**
+ * @brief 读取并解码png
+ *
+ * sourceNinePatch 时在解码每一行的同时把 COLUMN_* 列复制到 columns, 并把 alpha 取到 alpha 平面
+ */
 extern void read_png(const char *imageName,
                      png_structp read_ptr, png_infop read_info,
-                     image_info *outImageInfo);
+                     image_info *outImageInfo, bool sourceNinePatch = false);
+
+/**
+ * @brief 从已解码的像素行收集 COLUMN_* 列与 alpha 平面, 用于未在读取时收集的图片
+ */
+extern bool gather_source_data(image_info *image);
 
 /**
  * @brief 原始.9.png
@@ -69,31 +237,49 @@ extern status_t do_9patch(const char *imageName, image_info *image);
  */
 extern status_t do_aapt9patch(char const *imageName, image_info *image);
 
-extern status_t get_horizontal_ticks(
-    png_bytep row, int width, bool transparent, bool required,
-    int32_t *outLeft, int32_t *outRight, const char **outError,
-    uint8_t *outDivs, bool multipleAllowed);
+// One edge of a source 9-patch frame, classified by tick_type. Indices are
+// frame pixels, so 0 and length - 1 are the corners.
+struct frame_edge
+{
+    ::std::vector<uint8_t> ticks;
+    int errorPixel; // first non-corner pixel that is not a valid frame color, -1 if none
+    const char *error;
+};
 
-extern status_t get_horizontal_layout_bounds_ticks(
-    png_bytep row, int width, bool transparent, bool required,
-    int32_t *outLeft, int32_t *outRight, const char **outError);
+enum
+{
+    FRAME_TOP,
+    FRAME_LEFT,
+    FRAME_BOTTOM,
+    FRAME_RIGHT
+};
 
-extern status_t get_vertical_ticks(
-    png_bytepp rows, int offset, int height, bool transparent, bool required,
-    int32_t *outTop, int32_t *outBottom, const char **outError,
+/**
+ * @brief 一次遍历原始.9.png的四条边框, 每个像素按 32 位整数比较分类
+ */
+extern void scan_9patch_frame(png_bytep top, png_bytep bottom, const uint32_t *left, const uint32_t *right,
+                              int width, int height, bool transparent, frame_edge edges[4]);
+
+extern status_t get_ticks(
+    const frame_edge &edge, bool required,
+    int32_t *outStart, int32_t *outEnd, const char **outError,
     uint8_t *outDivs, bool multipleAllowed);
 
-extern status_t get_vertical_layout_bounds_ticks(
-    png_bytepp rows, int offset, int height, bool transparent, bool required,
-    int32_t *outTop, int32_t *outBottom, const char **outError);
+extern void get_layout_bounds_ticks(const frame_edge &edge, int32_t *outStart, int32_t *outEnd);
 
-extern void find_max_opacity(png_byte **rows,
+/**
+ * @brief 在 alpha 平面上从 (startX, startY) 按 (dX, dY) 前进, 求第一个最大 alpha 的步数
+ *
+ * 遇到完全不透明的像素即停止. 沿行前进时使用 alpha_find/alpha_max.
+ */
+extern void find_max_opacity(const png_byte *alpha, size_t stride,
                              int startX, int startY, int endX, int endY, int dX, int dY,
                              int *out_inset);
 
-extern uint8_t max_alpha_over_row(png_byte *row, int startX, int endX);
+// Same as find_max_opacity along a gathered column, from start towards end
+extern void find_max_opacity_col(const uint32_t *column, int start, int end, int d, int *out_inset);
 
-extern uint8_t max_alpha_over_col(png_byte **rows, int offsetX, int startY, int endY);
+extern uint8_t max_alpha_over_row(const png_byte *alpha, int startX, int endX);
 
 extern void get_outline(image_info *image);
 
@@ -102,30 +288,134 @@ extern uint32_t get_color(
 
 extern uint32_t get_color(image_info *image, int hpatch, int vpatch);
 
-extern int tick_type(png_bytep p, bool transparent, const char **outError);
+/**
+ * @brief 一次遍历计算所有色块的颜色, 结果与对每个色块调用 get_color 相同
+ *
+ * 第 c 列为 [cols[2c], cols[2c+1]), 第 r 行为 [patchRows[2r], patchRows[2r+1]), 颜色按行优先写入 colors.
+ * alpha 不为空时, 透明色块只检查 alpha 平面 (与 rows 同一原点, 每行 alphaStride 字节).
+ * test/patch-colors-test.cpp 以 get_color 为基准逐个检查.
+ */
+extern void get_patch_colors(png_bytepp rows, const png_byte *alpha, size_t alphaStride,
+                             const int32_t *cols, int numCols,
+                             const int32_t *patchRows, int numRows, uint32_t *colors);
+
+extern int tick_type(uint32_t color, bool transparent, const char **outError);
 
 extern void select_patch(
     int which, int front, int back, int size, int *start, int *end);
 
-extern uint8_t max_alpha_over_row(png_byte *row, int startX, int endX);
-
-extern void checkNinePatchSerialization(Res_png_9patch *inPatch, void *data);
+extern void checkNinePatchSerialization(image_info *image, void *data);
 
 extern void dump_image(int w, int h, png_bytepp rows, int color_type);
 
 extern void analyze_image(const char *imageName, image_info &imageInfo, int grayscaleTolerance,
-                          png_colorp rgbPalette, png_bytep alphaPalette,
-                          int *paletteEntries, bool *hasTransparency, int *colorType,
-                          png_bytepp outRows);
+                          image_analysis *analysis);
+
+/**
+ * @brief 将一行 RGBA 转换为 analysis.colorType 对应的格式
+ * @return 可直接交给 png_write_row 的行, out 至少需要 2 * width 字节
+ */
+extern png_bytep convert_row(const image_analysis &analysis, png_bytep row, int width, png_bytep out);
+
+// zlib/libpng settings for one encoding; strategy -1 leaves the choice to libpng
+struct png_compression
+{
+    int level;
+    int strategy;
+    int filters;
+};
+
+/**
+ * @brief 压缩方案(COMPRESSION_PROFILE)对应的设置
+ */
+extern png_compression compression_for_profile(int profile, int colorType);
+
+/**
+ * @brief 分析图像并确定最终的颜色类型
+ */
+extern void prepare_write(const char *imageName, image_info &imageInfo, const Bundle *bundle,
+                          image_analysis *analysis);
+
+/**
+ * @brief 按已分析的结果和给定的压缩设置写出图像
+ *
+ * 错误记录到 error (可为空) 而不是 imageInfo.error, 以便并行的压缩尝试共享 imageInfo.
+ * 输出行与 chunk 数据放在 buffers 中, buffers 不能为空, 且必须属于 setjmp 所在的调用方,
+ * png_error 跳出时由调用方释放.
+ */
+extern void encode_png(const char *imageName,
+                       png_structp write_ptr, png_infop write_info,
+                       image_info &imageInfo, const image_analysis &analysis,
+                       const png_compression &compression, Aapt9PNGError *error,
+                       png_row_buffers *buffers);
 
 extern void write_png(const char *imageName,
                       png_structp write_ptr, png_infop write_info,
-                      image_info &imageInfo, const Bundle *bundle);
+                      image_info &imageInfo, const Bundle *bundle, png_row_buffers *buffers);
+
+/**
+ * @brief 尝试多种 zlib 策略和过滤器, 输出最小的结果 (COMPRESSION_MAX)
+ */
+extern bool write_png_smallest(const char *imageName, image_info &imageInfo, const Bundle *bundle,
+                               ::std::vector<png_byte> *out);
+
+// An encoded PNG held in memory, consumed from |offset|
+struct png_memory_source
+{
+    png_memory_source(const png_byte *data, size_t size) : data(data), size(size), offset(0) {}
+
+    const png_byte *data;
+    size_t size;
+    size_t offset;
+};
+
+/**
+ * @brief 解析 aapt 写入的 npTc/npOl/npLb chunk
+ * @return 1 已处理, 0 不是.9信息, -1 数据有误
+ */
+extern int parse_9patch_chunk(image_info *image, const char *name, const png_byte *data, size_t size);
+
+/**
+ * @brief 只遍历 png 的 chunk, 读取尺寸与.9信息, 遇到第一个 IDAT 即停止, 不解码像素
+ */
+extern bool read_9patch_chunks_only(const png_byte *data, size_t size, image_info *imageInfo);
+
+/**
+ * @brief 生成 npOl/npLb/npTc chunk, 数据由调用方 free
+ * @return chunk 数量
+ */
+extern int make_9patch_chunks(image_info &imageInfo, png_unknown_chunk unknowns[3]);
+
+/**
+ * @brief 只替换.9信息的 chunk, 其余 chunk (包括 IDAT) 原样复制, 不重新编码像素
+ */
+extern bool rewrite_9patch_chunks(const png_byte *data, size_t size, image_info &imageInfo,
+                                  ::std::vector<png_byte> *out);
+
+// Where read_png_*_protected takes the 9-patch data from
+enum
+{
+    NINE_PATCH_NONE,   // plain png, the data comes from elsewhere
+    NINE_PATCH_CHUNKS, // compiled 9-patch, npTc/npOl/npLb chunks
+    NINE_PATCH_SOURCE  // source 9-patch, the 1-pixel frame (stripped by do_9patch)
+};
 
 bool read_png_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
                         String8 const &file, FILE *fp, image_info *imageInfo);
 
+/**
+ * @brief 从内存读取png, ninePatch 为 NINE_PATCH_* 之一
+ */
+bool read_png_buffer_protected(png_structp read_ptr, String8 const &printableName, png_infop read_info,
+                               png_memory_source *source, int ninePatch, image_info *imageInfo);
+
 bool write_png_protected(png_structp write_ptr, String8 const &printableName, png_infop write_info,
                          image_info *imageInfo, Bundle const *bundle);
 
+/**
+ * @brief 将png写入内存 out
+ */
+bool write_png_buffer_protected(png_structp write_ptr, String8 const &printableName, png_infop write_info,
+                                image_info *imageInfo, Bundle const *bundle, ::std::vector<png_byte> *out);
+
 #endif
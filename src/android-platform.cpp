@@ -2,6 +2,8 @@
 #include "android-platform.hpp"
 #include <arpa/inet.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
 
 void Res_png_9patch::deviceToFile()
@@ -1,29 +1,274 @@
 #include "core.hpp"
 #include <cstdlib>
+#include <cstdio>
 #include <unistd.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include "9png.hpp"
+#include "9png-batch.hpp"
+#include "9png-cache.hpp"
+#include "9png-index.hpp"
 #include "android-bundle.hpp"
 
 using ::std::string;
 
+static bool parse_profile(string const &name, int *profile)
+{
+    static const char *names[] = {"fast", "default", "best", "max"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++)
+    {
+        if (name == names[i])
+        {
+            *profile = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// 支持 K/M/G 后缀
+static bool parse_size(string const &text, uint64_t *size)
+{
+    char *end = nullptr;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+    {
+        return false;
+    }
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        value <<= 10;
+        // fallthrough
+    case 'M':
+    case 'm':
+        value <<= 10;
+        // fallthrough
+    case 'K':
+    case 'k':
+        value <<= 10;
+        end++;
+    }
+    *size = value;
+    return *end == 0;
+}
+
+static int print_cache_stats(string const &dir)
+{
+    Aapt9PNGCacheStats stats;
+    if (!GetAapt9PNGCacheStats(dir, &stats))
+    {
+        ::std::cerr << "无法读取缓存目录: " << dir << ::std::endl;
+        return 2;
+    }
+    uint64_t lookups = stats.hits + stats.misses;
+    ::std::cout << "条目 " << stats.entries << ", 大小 " << stats.bytes << " 字节" << ::std::endl;
+    ::std::cout << "命中 " << stats.hits << ", 未命中 " << stats.misses;
+    if (lookups)
+    {
+        ::std::cout << ", 命中率 " << (stats.hits * 100 / lookups) << "%";
+    }
+    ::std::cout << ::std::endl;
+    return 0;
+}
+
+// 索引中的名称: 相对于批处理目录的路径, 去掉 .9.png
+static string index_name(string const &source, string const &pkgpng)
+{
+    string name = pkgpng;
+    if (name.compare(0, source.length() + 1, source + "/") == 0)
+    {
+        name = name.substr(source.length() + 1);
+    }
+    if (name.length() > 6 && name.compare(name.length() - 6, 6, ".9.png") == 0)
+    {
+        name = name.substr(0, name.length() - 6);
+    }
+    return name;
+}
+
+static int write_index(string const &source, string const &index, Bundle const *bundle)
+{
+    ::std::vector<Aapt9PNGJob> jobs;
+    if (!CollectAapt9PNGJobs(source, "", true, bundle, jobs))
+    {
+        ::std::cerr << "无法读取批处理输入: " << source << ::std::endl;
+        return 2;
+    }
+
+    ::std::vector<::std::pair<string, string>> inputs;
+    for (auto const &job : jobs)
+    {
+        inputs.push_back(::std::make_pair(index_name(source, job.pkgpng), job.pkgpng));
+    }
+
+    ::std::vector<string> failed;
+    if (!WriteAapt9PNGIndex(index, inputs, &failed))
+    {
+        ::std::cerr << "无法写入索引: " << index << ::std::endl;
+        return 2;
+    }
+    for (auto const &path : failed)
+    {
+        ::std::cerr << "FAILED " << path << ::std::endl;
+    }
+    ::std::cout << "索引 " << (inputs.size() - failed.size()) << " 个文件, 失败 " << failed.size() << ::std::endl;
+    return failed.empty() ? 0 : 2;
+}
+
+static int lookup_index(string const &index, string const &name, string const &json, Bundle const *bundle)
+{
+    Aapt9PNGIndex file;
+    if (!file.open(index))
+    {
+        ::std::cerr << "无法读取索引: " << index << ::std::endl;
+        return 2;
+    }
+
+    ::std::vector<uint8_t> out;
+    if (!LookupAapt9PNGIndex(file, name, out, bundle))
+    {
+        ::std::cerr << "索引中没有: " << name << ::std::endl;
+        return 2;
+    }
+
+    if (json.empty())
+    {
+        ::std::cout.write((char const *)out.data(), out.size());
+        return 0;
+    }
+    FILE *fp = fopen(json.c_str(), "wb");
+    bool written = fp && fwrite(out.data(), 1, out.size(), fp) == out.size();
+    return fp && fclose(fp) == 0 && written ? 0 : 2;
+}
+
+static void print_error(string const &path, Aapt9PNGError const &error)
+{
+    for (auto const &warning : error.warnings)
+    {
+        ::std::cerr << path << ": 警告: " << warning << ::std::endl;
+    }
+    if (error.code == AAPT9PNG_OK)
+    {
+        return;
+    }
+    ::std::cerr << path << ": " << error.message << ::std::endl;
+    if (!error.edge.empty())
+    {
+        ::std::cerr << "       ";
+        if (error.pixel >= 0)
+        {
+            ::std::cerr << "位于 " << error.edge << " 边的第 " << error.pixel << " 个像素" << ::std::endl;
+        }
+        else
+        {
+            ::std::cerr << "位于 " << error.edge << " 边" << ::std::endl;
+        }
+    }
+}
+
+static int run_single(string const &pkgpng, string const &json, string const &png, string const &source,
+                      bool decodedMode, Bundle const *bundle)
+{
+    bool suc;
+    Aapt9PNGError error;
+    if (decodedMode)
+    {
+        suc = DecodeAapt9PNG(pkgpng, json, png, bundle, &error);
+    }
+    else if (!source.empty())
+    {
+        suc = CompileAapt9PNG(pkgpng, source, bundle, &error);
+    }
+    else
+    {
+        suc = EncodeAapt9PNG(pkgpng, json, png, bundle, &error);
+    }
+
+    print_error(pkgpng, error);
+    if (!suc)
+    {
+        ::std::cerr << "处理失败" << ::std::endl;
+        return 2;
+    }
+
+    return 0;
+}
+
+static int run_batch(string const &source, string const &outdir, string const &manifest, bool decodedMode, int threads,
+                     Bundle const *bundle)
+{
+    ::std::vector<Aapt9PNGJob> jobs;
+    if (!CollectAapt9PNGJobs(source, outdir, decodedMode, bundle, jobs))
+    {
+        ::std::cerr << "无法读取批处理输入: " << source << ::std::endl;
+        return 2;
+    }
+
+    int succeeded = manifest.empty() ? RunAapt9PNGJobs(jobs, decodedMode, threads, bundle)
+                                     : RunAapt9PNGJobsIncremental(jobs, decodedMode, threads, bundle, manifest);
+
+    // 汇总
+    for (auto const &job : jobs)
+    {
+        if (job.upToDate)
+        {
+            ::std::cout << "SKIP   " << job.pkgpng << ::std::endl;
+        }
+        else if (job.success)
+        {
+            ::std::cout << "OK     " << job.pkgpng << ::std::endl;
+        }
+        else
+        {
+            ::std::cerr << "FAILED " << job.pkgpng << ::std::endl;
+        }
+        print_error(job.pkgpng, job.error);
+    }
+    ::std::cout << "处理 " << jobs.size() << " 个文件, 成功 " << succeeded
+                << ", 失败 " << (jobs.size() - succeeded) << ::std::endl;
+
+    return succeeded == (int)jobs.size() ? 0 : 2;
+}
+
 int main(int argc, char **argv)
 {
     /**
      * -d 输入的 aapt.9.png 解压为 png/json
      * -c 合并 png/json 为 aapt.9.png
+     * -s 原始.9.png (带1像素边框), 与 -c 一起使用时编译为 -c 指定的 aapt.9.png, 不需要 -j/-p
      * -j json描述
-     * -p png图片路径
+     * -p png图片路径, 解压时省略则只输出.9信息
      * -m minsdk
+     * -b 批处理, -d/-c 的参数为目录或清单文件(每行 "aapt.9.png json png")
+     * -o 批处理的输出目录
+     * -t 批处理的工作线程数, 默认为cpu核数
+     * -i 增量批处理的 manifest 文件, 只处理输入或设置变化的文件, 并删除已移除输入的输出
+     * -P 解压输出缩进换行的json, 默认为紧凑格式
+     * -F .9信息格式 json|binary, 默认为json; 合并时自动识别
+     * -x 索引文件. 与 -b -d 一起使用时将整个目录的.9信息写入一个索引(只读取 chunk, 不输出png);
+     *    与 -q 一起使用时从索引中查找
+     * -q 要查找的名称(相对于批处理目录的路径, 不含 .9.png), 结果写入 -j 指定的文件, 省略时输出到标准输出
+     * -z 压缩方案 fast|default|best|max, 默认为best
+     * -C 结果缓存目录, 命中时输出为缓存文件的硬链接
+     * -L 缓存大小上限(支持K/M/G后缀), 运行结束后淘汰最久未使用的条目
+     * -S 输出 -C 指定的缓存目录的统计信息
+     * -v 输出更多诊断信息到标准错误, 可重复; 调试信息只在 Debug 构建中可用
      */
 
     int opt;
     bool decodedMode = false;
-    string pkgpng, json, png;
+    bool batchMode = false;
+    bool showStats = false;
+    int threads = 0;
+    uint64_t cacheLimit = 0;
+    int verbosity = AAPT9PNG_LOG_WARN;
+    string pkgpng, json, png, source, outdir, manifest, index, query;
     Bundle bundle;
 
-    while ((opt = getopt(argc, argv, "d:c:j:p:m")) != -1)
+    while ((opt = getopt(argc, argv, "d:c:s:j:p:m:bo:t:i:PF:x:q:z:C:L:Sv")) != -1)
     {
         switch (opt)
         {
@@ -35,6 +280,9 @@ int main(int argc, char **argv)
             decodedMode = false;
             pkgpng = optarg;
             break;
+        case 's':
+            source = optarg;
+            break;
         case 'j':
             json = optarg;
             break;
@@ -44,24 +292,97 @@ int main(int argc, char **argv)
         case 'm':
             bundle.minSdk = atoi(optarg);
             break;
+        case 'b':
+            batchMode = true;
+            break;
+        case 'o':
+            outdir = optarg;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'i':
+            manifest = optarg;
+            break;
+        case 'P':
+            bundle.prettyJson = true;
+            break;
+        case 'F':
+            if (string(optarg) == "json")
+            {
+                bundle.metadataFormat = METADATA_JSON;
+            }
+            else if (string(optarg) == "binary")
+            {
+                bundle.metadataFormat = METADATA_BINARY;
+            }
+            else
+            {
+                ::std::cerr << "未知的.9信息格式: " << optarg << ::std::endl;
+                return 1;
+            }
+            break;
+        case 'x':
+            index = optarg;
+            break;
+        case 'q':
+            query = optarg;
+            break;
+        case 'z':
+            if (!parse_profile(optarg, &bundle.compressionProfile))
+            {
+                ::std::cerr << "未知的压缩方案: " << optarg << ::std::endl;
+                return 1;
+            }
+            break;
+        case 'C':
+            bundle.cacheDir = optarg;
+            break;
+        case 'L':
+            if (!parse_size(optarg, &cacheLimit))
+            {
+                ::std::cerr << "无效的缓存大小: " << optarg << ::std::endl;
+                return 1;
+            }
+            break;
+        case 'S':
+            showStats = true;
+            break;
+        case 'v':
+            verbosity++;
+            break;
         }
     }
+    SetAapt9PNGLogLevel(verbosity);
 
-    bool suc;
-    if (decodedMode)
+    if (showStats)
     {
-        suc = DecodeAapt9PNG(pkgpng, json, png);
+        return print_cache_stats(bundle.cacheDir);
     }
-    else
+    if (!index.empty() && !query.empty())
     {
-        suc = EncodeAapt9PNG(pkgpng, json, png, &bundle);
+        return lookup_index(index, query, json, &bundle);
     }
-
-    if (!suc)
+    if (!index.empty() && batchMode && decodedMode)
     {
-        ::std::cerr << "处理失败" << ::std::endl;
-        return 2;
+        return write_index(pkgpng, index, &bundle);
+    }
+    if (!source.empty() && (batchMode || decodedMode))
+    {
+        ::std::cerr << "-s 只能与 -c 一起用于单个文件" << ::std::endl;
+        return 1;
     }
 
-    return 0;
+    int ret = batchMode ? run_batch(pkgpng, outdir, manifest, decodedMode, threads, &bundle)
+                        : run_single(pkgpng, json, png, source, decodedMode, &bundle);
+
+    if (!bundle.cacheDir.empty())
+    {
+        FlushAapt9PNGCacheStats(bundle.cacheDir);
+        if (cacheLimit)
+        {
+            TrimAapt9PNGCache(bundle.cacheDir, cacheLimit);
+        }
+    }
+    return ret;
 }
@@ -1,6 +1,6 @@
 #ifndef __CORE_H_INCLUDED
 #define __CORE_H_INCLUDED
 
-#define IS_DEBUG true
+#include "9png-log.hpp"
 
 #endif
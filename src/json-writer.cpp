@@ -0,0 +1,151 @@
+#include "json-writer.hpp"
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+JsonWriter::JsonWriter(::std::vector<uint8_t> &out, bool pretty)
+    : out_(out), pretty_(pretty), depth_(0), afterKey_(false)
+{
+    first_[0] = true;
+    inArray_[0] = false;
+}
+
+void JsonWriter::append(char const *text, size_t size)
+{
+    out_.insert(out_.end(), (uint8_t const *)text, (uint8_t const *)text + size);
+}
+
+void JsonWriter::newline()
+{
+    if (!pretty_)
+    {
+        return;
+    }
+    out_.push_back('\n');
+    out_.insert(out_.end(), depth_ * 4, ' ');
+}
+
+// 值之前的逗号与换行; 紧跟在键之后的值不需要
+void JsonWriter::separate()
+{
+    if (afterKey_)
+    {
+        afterKey_ = false;
+        return;
+    }
+    if (!first_[depth_])
+    {
+        out_.push_back(',');
+        if (pretty_ && inArray_[depth_])
+        {
+            out_.push_back(' ');
+        }
+    }
+    first_[depth_] = false;
+    if (depth_ > 0 && !inArray_[depth_])
+    {
+        newline();
+    }
+}
+
+void JsonWriter::beginObject()
+{
+    separate();
+    out_.push_back('{');
+    depth_++;
+    first_[depth_] = true;
+    inArray_[depth_] = false;
+}
+
+void JsonWriter::endObject()
+{
+    bool empty = first_[depth_];
+    depth_--;
+    if (!empty)
+    {
+        newline();
+    }
+    out_.push_back('}');
+    if (pretty_ && depth_ == 0)
+    {
+        out_.push_back('\n');
+    }
+}
+
+void JsonWriter::beginArray()
+{
+    separate();
+    out_.push_back('[');
+    depth_++;
+    first_[depth_] = true;
+    inArray_[depth_] = true;
+}
+
+void JsonWriter::endArray()
+{
+    depth_--;
+    out_.push_back(']');
+}
+
+void JsonWriter::key(char const *name)
+{
+    separate();
+    out_.push_back('"');
+    append(name, strlen(name));
+    append(pretty_ ? "\": " : "\":", pretty_ ? 3 : 2);
+    afterKey_ = true;
+}
+
+void JsonWriter::value(int64_t number)
+{
+    separate();
+
+    // 从低位开始写入临时缓冲区, 避免 snprintf 的格式解析
+    char buf[24];
+    char *end = buf + sizeof(buf), *p = end;
+    uint64_t magnitude = number < 0 ? 0 - (uint64_t)number : (uint64_t)number;
+    do
+    {
+        *--p = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude);
+    if (number < 0)
+    {
+        *--p = '-';
+    }
+    append(p, end - p);
+}
+
+void JsonWriter::value(float number)
+{
+    separate();
+
+    // json 无法表示 inf/nan
+    if (!::std::isfinite(number))
+    {
+        append("0", 1);
+        return;
+    }
+
+    // 9 位有效数字可以精确还原 float
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.9g", number);
+
+    // %g 的小数点随 LC_NUMERIC 变化 (如 de_DE 中为逗号, 也可能是多字节),
+    // 输出中数字, 符号与指数以外的字节只能是小数点, 统一替换为 '.'.
+    // 不调用 localeconv, 它返回的静态结构在多线程下不安全
+    int size = 0;
+    for (int i = 0; i < n; i++)
+    {
+        char c = buf[i];
+        if ((c >= '0' && c <= '9') || c == '-' || c == '+' || c == 'e')
+        {
+            buf[size++] = c;
+        }
+        else if (size == 0 || buf[size - 1] != '.')
+        {
+            buf[size++] = '.';
+        }
+    }
+    append(buf, size);
+}
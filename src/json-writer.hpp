@@ -0,0 +1,46 @@
+#ifndef __JSON_WRITER_H_INCLUDED
+#define __JSON_WRITER_H_INCLUDED
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief 直接追加到输出缓冲区的 json 写入器, 不构建 jsoncpp 的 DOM
+ *
+ * 紧凑模式不输出任何空白; pretty 模式下对象逐行缩进, 数组保持在一行.
+ * 键由调用方保证不需要转义. 浮点数总是以 '.' 作小数点, 与 LC_NUMERIC 无关.
+ */
+class JsonWriter
+{
+public:
+    JsonWriter(::std::vector<uint8_t> &out, bool pretty);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    void key(char const *name);
+    void value(int64_t number);
+    void value(float number);
+
+private:
+    void separate();
+    void newline();
+    void append(char const *text, size_t size);
+
+    enum
+    {
+        MAX_DEPTH = 16
+    };
+
+    ::std::vector<uint8_t> &out_;
+    bool pretty_;
+    int depth_;
+    bool first_[MAX_DEPTH];
+    bool inArray_[MAX_DEPTH];
+    bool afterKey_;
+};
+
+#endif
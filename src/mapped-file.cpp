@@ -0,0 +1,56 @@
+#include "mapped-file.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(::std::string const &path)
+{
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // 空文件无法映射, 作为长度为0的数据处理
+    if (st.st_size > 0)
+    {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data_ = (uint8_t const *)addr;
+        size_ = st.st_size;
+    }
+
+    // 映射建立后不再需要文件描述符
+    ::close(fd);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (data_)
+    {
+        munmap((void *)data_, size_);
+    }
+    data_ = nullptr;
+    size_ = 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __MAPPED_FILE_H_INCLUDED
+#define __MAPPED_FILE_H_INCLUDED
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief 只读映射整个文件, 析构时解除映射
+ */
+class MappedFile
+{
+public:
+    MappedFile() : data_(nullptr), size_(0) {}
+    ~MappedFile();
+
+    bool open(::std::string const &path);
+    void close();
+
+    uint8_t const *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    MappedFile(MappedFile const &);
+    MappedFile &operator=(MappedFile const &);
+
+    uint8_t const *data_;
+    size_t size_;
+};
+
+#endif
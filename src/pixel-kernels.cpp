@@ -0,0 +1,797 @@
+#include "pixel-kernels.hpp"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+using ::std::max;
+using ::std::min;
+
+typedef void (*scan_gray_opacity_fn)(const uint8_t *, size_t, int *, int *);
+typedef void (*compact_gray_row_fn)(const uint8_t *, size_t, uint8_t *, bool, bool);
+typedef bool (*pixels_uniform_fn)(const uint8_t *, size_t, uint32_t, uint32_t);
+typedef void (*extract_alpha_fn)(const uint8_t *, size_t, uint8_t *);
+typedef uint8_t (*alpha_max_fn)(const uint8_t *, size_t);
+typedef size_t (*alpha_find_fn)(const uint8_t *, size_t, uint8_t);
+
+// Reference luminance, kept as the float expression the encoder has always used
+static inline uint8_t luminance_of(int rr, int gg, int bb)
+{
+    return (uint8_t)(rr * 0.2126f + gg * 0.7152f + bb * 0.0722f);
+}
+
+// Fixed-point weights in 9.23 format. For every RGB triple the integer sum
+// truncates to the float result, except that float rounding may carry a sum
+// whose fraction is within LUMA_CARRY_WINDOW of the next integer up to it;
+// the vector kernels recompute those few pixels with luminance_of().
+#define LUMA_SHIFT 23
+#define LUMA_WEIGHT_R 1783418
+#define LUMA_WEIGHT_G 5999532
+#define LUMA_WEIGHT_B 605657
+#define LUMA_CARRY_WINDOW 256
+
+static void scan_gray_opacity_scalar(const uint8_t *p, size_t count,
+                                     int *maxGrayDeviation, int *minAlpha)
+{
+    int dev = *maxGrayDeviation;
+    int alpha = *minAlpha;
+    for (size_t i = 0; i < count; i++, p += 4)
+    {
+        int rr = p[0], gg = p[1], bb = p[2];
+        dev = max(dev, abs(rr - gg));
+        dev = max(dev, abs(gg - bb));
+        dev = max(dev, abs(bb - rr));
+        alpha = min(alpha, (int)p[3]);
+    }
+    *maxGrayDeviation = dev;
+    *minAlpha = alpha;
+}
+
+static void compact_gray_row_scalar(const uint8_t *p, size_t count, uint8_t *out,
+                                    bool luminance, bool withAlpha)
+{
+    for (size_t i = 0; i < count; i++, p += 4)
+    {
+        *out++ = luminance ? luminance_of(p[0], p[1], p[2]) : p[0];
+        if (withAlpha)
+        {
+            *out++ = p[3];
+        }
+    }
+}
+
+// Pixels and reference are compared as native 32-bit words under mask
+static bool pixels_uniform_scalar(const uint8_t *p, size_t count, uint32_t reference, uint32_t mask)
+{
+    for (size_t i = 0; i < count; i++, p += 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        if ((v & mask) != reference)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void extract_alpha_scalar(const uint8_t *p, size_t count, uint8_t *out)
+{
+    for (size_t i = 0; i < count; i++, p += 4)
+    {
+        out[i] = p[3];
+    }
+}
+
+static uint8_t alpha_max_scalar(const uint8_t *a, size_t count)
+{
+    uint8_t m = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        m = max(m, a[i]);
+    }
+    return m;
+}
+
+static size_t alpha_find_scalar(const uint8_t *a, size_t count, uint8_t value)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (a[i] == value)
+        {
+            return i;
+        }
+    }
+    return count;
+}
+
+static size_t alpha_rfind_scalar(const uint8_t *a, size_t count, uint8_t value)
+{
+    for (size_t i = count; i > 0; i--)
+    {
+        if (a[i - 1] == value)
+        {
+            return i - 1;
+        }
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Per 32-bit lane (r g b a), shifting right by 8 and 16 bits lines g/b and
+// b up under r/g, so one byte-wise absolute difference gives |r-g|, |g-b|
+// and the other |r-b|. Alpha is isolated by or-ing the color bytes to 0xff.
+
+#define ABSDIFF_EPU8(a, b) _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a))
+
+__attribute__((target("sse2"))) static inline void classify_sse2(
+    __m128i v, __m128i &devAcc, __m128i &alphaAcc)
+{
+    const __m128i rgMask = _mm_set1_epi32(0x0000ffff);
+    const __m128i rMask = _mm_set1_epi32(0x000000ff);
+    const __m128i colorBits = _mm_set1_epi32(0x00ffffff);
+    __m128i d1 = _mm_and_si128(ABSDIFF_EPU8(v, _mm_srli_epi32(v, 8)), rgMask);
+    __m128i d2 = _mm_and_si128(ABSDIFF_EPU8(v, _mm_srli_epi32(v, 16)), rMask);
+    devAcc = _mm_max_epu8(devAcc, _mm_max_epu8(d1, d2));
+    alphaAcc = _mm_min_epu8(alphaAcc, _mm_or_si128(v, colorBits));
+}
+
+__attribute__((target("sse2"))) static void scan_gray_opacity_sse2(
+    const uint8_t *p, size_t count, int *maxGrayDeviation, int *minAlpha)
+{
+    __m128i devAcc = _mm_setzero_si128();
+    __m128i alphaAcc = _mm_set1_epi8((char)0xff);
+    size_t i = 0;
+
+    // 16 pixels per iteration
+    for (; i + 16 <= count; i += 16, p += 64)
+    {
+        classify_sse2(_mm_loadu_si128((const __m128i *)p), devAcc, alphaAcc);
+        classify_sse2(_mm_loadu_si128((const __m128i *)(p + 16)), devAcc, alphaAcc);
+        classify_sse2(_mm_loadu_si128((const __m128i *)(p + 32)), devAcc, alphaAcc);
+        classify_sse2(_mm_loadu_si128((const __m128i *)(p + 48)), devAcc, alphaAcc);
+    }
+    for (; i + 4 <= count; i += 4, p += 16)
+    {
+        classify_sse2(_mm_loadu_si128((const __m128i *)p), devAcc, alphaAcc);
+    }
+
+    uint8_t dev[16], alpha[16];
+    _mm_storeu_si128((__m128i *)dev, devAcc);
+    _mm_storeu_si128((__m128i *)alpha, alphaAcc);
+    for (int k = 0; k < 16; k++)
+    {
+        *maxGrayDeviation = max(*maxGrayDeviation, (int)dev[k]);
+        *minAlpha = min(*minAlpha, (int)alpha[k]);
+    }
+
+    scan_gray_opacity_scalar(p, count - i, maxGrayDeviation, minAlpha);
+}
+
+#define ABSDIFF_EPU8_256(a, b) _mm256_or_si256(_mm256_subs_epu8(a, b), _mm256_subs_epu8(b, a))
+
+__attribute__((target("avx2"))) static inline void classify_avx2(
+    __m256i v, __m256i &devAcc, __m256i &alphaAcc)
+{
+    const __m256i rgMask = _mm256_set1_epi32(0x0000ffff);
+    const __m256i rMask = _mm256_set1_epi32(0x000000ff);
+    const __m256i colorBits = _mm256_set1_epi32(0x00ffffff);
+    __m256i d1 = _mm256_and_si256(ABSDIFF_EPU8_256(v, _mm256_srli_epi32(v, 8)), rgMask);
+    __m256i d2 = _mm256_and_si256(ABSDIFF_EPU8_256(v, _mm256_srli_epi32(v, 16)), rMask);
+    devAcc = _mm256_max_epu8(devAcc, _mm256_max_epu8(d1, d2));
+    alphaAcc = _mm256_min_epu8(alphaAcc, _mm256_or_si256(v, colorBits));
+}
+
+__attribute__((target("avx2"))) static void scan_gray_opacity_avx2(
+    const uint8_t *p, size_t count, int *maxGrayDeviation, int *minAlpha)
+{
+    __m256i devAcc = _mm256_setzero_si256();
+    __m256i alphaAcc = _mm256_set1_epi8((char)0xff);
+    size_t i = 0;
+
+    // 32 pixels per iteration
+    for (; i + 32 <= count; i += 32, p += 128)
+    {
+        classify_avx2(_mm256_loadu_si256((const __m256i *)p), devAcc, alphaAcc);
+        classify_avx2(_mm256_loadu_si256((const __m256i *)(p + 32)), devAcc, alphaAcc);
+        classify_avx2(_mm256_loadu_si256((const __m256i *)(p + 64)), devAcc, alphaAcc);
+        classify_avx2(_mm256_loadu_si256((const __m256i *)(p + 96)), devAcc, alphaAcc);
+    }
+    for (; i + 8 <= count; i += 8, p += 32)
+    {
+        classify_avx2(_mm256_loadu_si256((const __m256i *)p), devAcc, alphaAcc);
+    }
+
+    uint8_t dev[32], alpha[32];
+    _mm256_storeu_si256((__m256i *)dev, devAcc);
+    _mm256_storeu_si256((__m256i *)alpha, alphaAcc);
+    for (int k = 0; k < 32; k++)
+    {
+        *maxGrayDeviation = max(*maxGrayDeviation, (int)dev[k]);
+        *minAlpha = min(*minAlpha, (int)alpha[k]);
+    }
+
+    scan_gray_opacity_scalar(p, count - i, maxGrayDeviation, minAlpha);
+}
+
+// Gray values for up to 8 pixels whose fixed-point sums fell into the carry
+// window are redone with the float reference.
+static inline void fix_luminance_carries(const uint8_t *p, uint8_t *out, int carryMask, bool withAlpha)
+{
+    for (int k = 0; carryMask; k++, carryMask >>= 1)
+    {
+        if (carryMask & 1)
+        {
+            out[withAlpha ? 2 * k : k] = luminance_of(p[4 * k], p[4 * k + 1], p[4 * k + 2]);
+        }
+    }
+}
+
+__attribute__((target("sse4.1"))) static void compact_gray_row_sse41(
+    const uint8_t *p, size_t count, uint8_t *out, bool luminance, bool withAlpha)
+{
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i wr = _mm_set1_epi32(LUMA_WEIGHT_R);
+    const __m128i wg = _mm_set1_epi32(LUMA_WEIGHT_G);
+    const __m128i wb = _mm_set1_epi32(LUMA_WEIGHT_B);
+    const __m128i fracMask = _mm_set1_epi32((1 << LUMA_SHIFT) - 1);
+    const __m128i carryStart = _mm_set1_epi32((1 << LUMA_SHIFT) - LUMA_CARRY_WINDOW);
+    size_t i = 0;
+
+    // 4 pixels per iteration
+    for (; i + 4 <= count; i += 4, p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i gray = _mm_and_si128(v, byteMask);
+        int carryMask = 0;
+        if (luminance)
+        {
+            __m128i g = _mm_and_si128(_mm_srli_epi32(v, 8), byteMask);
+            __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), byteMask);
+            __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(gray, wr), _mm_mullo_epi32(g, wg)),
+                                        _mm_mullo_epi32(b, wb));
+            gray = _mm_srli_epi32(sum, LUMA_SHIFT);
+            carryMask = _mm_movemask_ps(_mm_castsi128_ps(
+                _mm_cmpgt_epi32(_mm_and_si128(sum, fracMask), carryStart)));
+        }
+
+        __m128i packed;
+        if (withAlpha)
+        {
+            packed = _mm_or_si128(gray, _mm_slli_epi32(_mm_srli_epi32(v, 24), 8));
+            packed = _mm_packus_epi32(packed, packed);
+            _mm_storel_epi64((__m128i *)out, packed);
+        }
+        else
+        {
+            packed = _mm_packus_epi32(gray, gray);
+            packed = _mm_packus_epi16(packed, packed);
+            *(int *)out = _mm_cvtsi128_si32(packed);
+        }
+        fix_luminance_carries(p, out, carryMask, withAlpha);
+        out += withAlpha ? 8 : 4;
+    }
+
+    compact_gray_row_scalar(p, count - i, out, luminance, withAlpha);
+}
+
+__attribute__((target("avx2"))) static void compact_gray_row_avx2(
+    const uint8_t *p, size_t count, uint8_t *out, bool luminance, bool withAlpha)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i wr = _mm256_set1_epi32(LUMA_WEIGHT_R);
+    const __m256i wg = _mm256_set1_epi32(LUMA_WEIGHT_G);
+    const __m256i wb = _mm256_set1_epi32(LUMA_WEIGHT_B);
+    const __m256i fracMask = _mm256_set1_epi32((1 << LUMA_SHIFT) - 1);
+    const __m256i carryStart = _mm256_set1_epi32((1 << LUMA_SHIFT) - LUMA_CARRY_WINDOW);
+    size_t i = 0;
+
+    // 8 pixels per iteration
+    for (; i + 8 <= count; i += 8, p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i gray = _mm256_and_si256(v, byteMask);
+        int carryMask = 0;
+        if (luminance)
+        {
+            __m256i g = _mm256_and_si256(_mm256_srli_epi32(v, 8), byteMask);
+            __m256i b = _mm256_and_si256(_mm256_srli_epi32(v, 16), byteMask);
+            __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(gray, wr), _mm256_mullo_epi32(g, wg)),
+                                           _mm256_mullo_epi32(b, wb));
+            gray = _mm256_srli_epi32(sum, LUMA_SHIFT);
+            carryMask = _mm256_movemask_ps(_mm256_castsi256_ps(
+                _mm256_cmpgt_epi32(_mm256_and_si256(sum, fracMask), carryStart)));
+        }
+
+        // packus works per 128-bit half, so gather the low part of each half
+        __m256i packed;
+        if (withAlpha)
+        {
+            packed = _mm256_or_si256(gray, _mm256_slli_epi32(_mm256_srli_epi32(v, 24), 8));
+            packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(packed, packed), 0x08);
+            _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(packed));
+        }
+        else
+        {
+            packed = _mm256_packus_epi32(gray, gray);
+            packed = _mm256_packus_epi16(packed, packed);
+            packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+            _mm_storel_epi64((__m128i *)out, _mm256_castsi256_si128(packed));
+        }
+        fix_luminance_carries(p, out, carryMask, withAlpha);
+        out += withAlpha ? 16 : 8;
+    }
+
+    compact_gray_row_scalar(p, count - i, out, luminance, withAlpha);
+}
+
+__attribute__((target("sse2"))) static bool pixels_uniform_sse2(
+    const uint8_t *p, size_t count, uint32_t reference, uint32_t mask)
+{
+    const __m128i ref = _mm_set1_epi32((int)reference);
+    const __m128i m = _mm_set1_epi32((int)mask);
+    size_t i = 0;
+
+    // 16 pixels per iteration, one movemask for all four compares
+    for (; i + 16 <= count; i += 16, p += 64)
+    {
+        __m128i e0 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)p), m), ref);
+        __m128i e1 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 16)), m), ref);
+        __m128i e2 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 32)), m), ref);
+        __m128i e3 = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 48)), m), ref);
+        __m128i all = _mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3));
+        if (_mm_movemask_epi8(all) != 0xffff)
+        {
+            return false;
+        }
+    }
+    for (; i + 4 <= count; i += 4, p += 16)
+    {
+        __m128i e = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)p), m), ref);
+        if (_mm_movemask_epi8(e) != 0xffff)
+        {
+            return false;
+        }
+    }
+
+    return pixels_uniform_scalar(p, count - i, reference, mask);
+}
+
+__attribute__((target("avx2"))) static bool pixels_uniform_avx2(
+    const uint8_t *p, size_t count, uint32_t reference, uint32_t mask)
+{
+    const __m256i ref = _mm256_set1_epi32((int)reference);
+    const __m256i m = _mm256_set1_epi32((int)mask);
+    size_t i = 0;
+
+    // 32 pixels per iteration
+    for (; i + 32 <= count; i += 32, p += 128)
+    {
+        __m256i e0 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)p), m), ref);
+        __m256i e1 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 32)), m), ref);
+        __m256i e2 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 64)), m), ref);
+        __m256i e3 = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + 96)), m), ref);
+        __m256i all = _mm256_and_si256(_mm256_and_si256(e0, e1), _mm256_and_si256(e2, e3));
+        if (_mm256_movemask_epi8(all) != -1)
+        {
+            return false;
+        }
+    }
+    for (; i + 8 <= count; i += 8, p += 32)
+    {
+        __m256i e = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)p), m), ref);
+        if (_mm256_movemask_epi8(e) != -1)
+        {
+            return false;
+        }
+    }
+
+    return pixels_uniform_scalar(p, count - i, reference, mask);
+}
+
+__attribute__((target("sse2"))) static void extract_alpha_sse2(const uint8_t *p, size_t count, uint8_t *out)
+{
+    size_t i = 0;
+
+    // 16 pixels per iteration; alpha values fit the signed 16-bit pack
+    for (; i + 16 <= count; i += 16, p += 64)
+    {
+        __m128i a0 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)p), 24);
+        __m128i a1 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(p + 16)), 24);
+        __m128i a2 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(p + 32)), 24);
+        __m128i a3 = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(p + 48)), 24);
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+        _mm_storeu_si128((__m128i *)(out + i), packed);
+    }
+
+    extract_alpha_scalar(p, count - i, out + i);
+}
+
+__attribute__((target("sse2"))) static uint8_t alpha_max_sse2(const uint8_t *a, size_t count)
+{
+    __m128i acc = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        acc = _mm_max_epu8(acc, _mm_loadu_si128((const __m128i *)(a + i)));
+    }
+
+    uint8_t lanes[16];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return max(alpha_max_scalar(lanes, 16), alpha_max_scalar(a + i, count - i));
+}
+
+__attribute__((target("sse2"))) static size_t alpha_find_sse2(const uint8_t *a, size_t count, uint8_t value)
+{
+    const __m128i v = _mm_set1_epi8((char)value);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), v));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + alpha_find_scalar(a + i, count - i, value);
+}
+
+__attribute__((target("sse2"))) static size_t alpha_rfind_sse2(const uint8_t *a, size_t count, uint8_t value)
+{
+    const __m128i v = _mm_set1_epi8((char)value);
+    size_t i = count;
+    for (; i >= 16; i -= 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i - 16)), v));
+        if (mask)
+        {
+            return i - 16 + (31 - __builtin_clz(mask));
+        }
+    }
+    size_t found = alpha_rfind_scalar(a, i, value);
+    return found < i ? found : count;
+}
+
+__attribute__((target("avx2"))) static void extract_alpha_avx2(const uint8_t *p, size_t count, uint8_t *out)
+{
+    // packs work per 128-bit half; this puts the dwords back in pixel order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    size_t i = 0;
+
+    // 32 pixels per iteration
+    for (; i + 32 <= count; i += 32, p += 128)
+    {
+        __m256i a0 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)p), 24);
+        __m256i a1 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(p + 32)), 24);
+        __m256i a2 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(p + 64)), 24);
+        __m256i a3 = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(p + 96)), 24);
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(a0, a1), _mm256_packs_epi32(a2, a3));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+
+    extract_alpha_sse2(p, count - i, out + i);
+}
+
+__attribute__((target("avx2"))) static uint8_t alpha_max_avx2(const uint8_t *a, size_t count)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        acc = _mm256_max_epu8(acc, _mm256_loadu_si256((const __m256i *)(a + i)));
+    }
+
+    uint8_t lanes[32];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return max(alpha_max_scalar(lanes, 32), alpha_max_sse2(a + i, count - i));
+}
+
+__attribute__((target("avx2"))) static size_t alpha_find_avx2(const uint8_t *a, size_t count, uint8_t value)
+{
+    const __m256i v = _mm256_set1_epi8((char)value);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), v));
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + alpha_find_sse2(a + i, count - i, value);
+}
+
+__attribute__((target("avx2"))) static size_t alpha_rfind_avx2(const uint8_t *a, size_t count, uint8_t value)
+{
+    const __m256i v = _mm256_set1_epi8((char)value);
+    size_t i = count;
+    for (; i >= 32; i -= 32)
+    {
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i - 32)), v));
+        if (mask)
+        {
+            return i - 32 + (31 - __builtin_clz(mask));
+        }
+    }
+    size_t found = alpha_rfind_sse2(a, i, value);
+    return found < i ? found : count;
+}
+
+#endif
+
+static scan_gray_opacity_fn select_scan_gray_opacity()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return scan_gray_opacity_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return scan_gray_opacity_sse2;
+    }
+#endif
+    return scan_gray_opacity_scalar;
+}
+
+void scan_gray_opacity(const uint8_t *pixels, size_t count,
+                       int *maxGrayDeviation, int *minAlpha)
+{
+    static const scan_gray_opacity_fn impl = select_scan_gray_opacity();
+    impl(pixels, count, maxGrayDeviation, minAlpha);
+}
+
+bool scan_gray_opacity_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count,
+                           int *maxGrayDeviation, int *minAlpha)
+{
+    scan_gray_opacity_fn impl = NULL;
+    switch (isa)
+    {
+    case PIXEL_KERNEL_SCALAR:
+        impl = scan_gray_opacity_scalar;
+        break;
+#ifdef HAVE_X86_KERNELS
+    case PIXEL_KERNEL_SSE:
+        __builtin_cpu_init();
+        impl = __builtin_cpu_supports("sse2") ? scan_gray_opacity_sse2 : NULL;
+        break;
+    case PIXEL_KERNEL_AVX2:
+        __builtin_cpu_init();
+        impl = __builtin_cpu_supports("avx2") ? scan_gray_opacity_avx2 : NULL;
+        break;
+#endif
+    default:
+        break;
+    }
+    if (!impl)
+    {
+        return false;
+    }
+    impl(pixels, count, maxGrayDeviation, minAlpha);
+    return true;
+}
+
+static compact_gray_row_fn select_compact_gray_row()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return compact_gray_row_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return compact_gray_row_sse41;
+    }
+#endif
+    return compact_gray_row_scalar;
+}
+
+void compact_gray_row(const uint8_t *pixels, size_t count, uint8_t *out,
+                      bool luminance, bool withAlpha)
+{
+    static const compact_gray_row_fn impl = select_compact_gray_row();
+    impl(pixels, count, out, luminance, withAlpha);
+}
+
+bool compact_gray_row_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count, uint8_t *out,
+                          bool luminance, bool withAlpha)
+{
+    compact_gray_row_fn impl = NULL;
+    switch (isa)
+    {
+    case PIXEL_KERNEL_SCALAR:
+        impl = compact_gray_row_scalar;
+        break;
+#ifdef HAVE_X86_KERNELS
+    case PIXEL_KERNEL_SSE:
+        __builtin_cpu_init();
+        impl = __builtin_cpu_supports("sse4.1") ? compact_gray_row_sse41 : NULL;
+        break;
+    case PIXEL_KERNEL_AVX2:
+        __builtin_cpu_init();
+        impl = __builtin_cpu_supports("avx2") ? compact_gray_row_avx2 : NULL;
+        break;
+#endif
+    default:
+        break;
+    }
+    if (!impl)
+    {
+        return false;
+    }
+    impl(pixels, count, out, luminance, withAlpha);
+    return true;
+}
+
+static pixels_uniform_fn select_pixels_uniform()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return pixels_uniform_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return pixels_uniform_sse2;
+    }
+#endif
+    return pixels_uniform_scalar;
+}
+
+bool pixels_uniform(const uint8_t *pixels, size_t count, const uint8_t *reference)
+{
+    static const pixels_uniform_fn impl = select_pixels_uniform();
+
+    // A transparent reference only constrains alpha, the fourth byte in memory
+    static const uint8_t alphaBytes[4] = {0, 0, 0, 0xff};
+    uint32_t mask = 0xffffffff;
+    uint32_t ref;
+    if (reference[3] == 0)
+    {
+        memcpy(&mask, alphaBytes, sizeof(mask));
+    }
+    memcpy(&ref, reference, sizeof(ref));
+    return impl(pixels, count, ref & mask, mask);
+}
+
+// The alpha kernels pick AVX2, then SSE2, then scalar
+#ifdef HAVE_X86_KERNELS
+#define SELECT_ALPHA_KERNEL(name)                 \
+    do                                            \
+    {                                             \
+        __builtin_cpu_init();                     \
+        if (__builtin_cpu_supports("avx2"))       \
+        {                                         \
+            return name##_avx2;                   \
+        }                                         \
+        if (__builtin_cpu_supports("sse2"))       \
+        {                                         \
+            return name##_sse2;                   \
+        }                                         \
+        return name##_scalar;                     \
+    } while (0)
+#else
+#define SELECT_ALPHA_KERNEL(name) return name##_scalar
+#endif
+
+static extract_alpha_fn select_extract_alpha()
+{
+    SELECT_ALPHA_KERNEL(extract_alpha);
+}
+
+static alpha_max_fn select_alpha_max()
+{
+    SELECT_ALPHA_KERNEL(alpha_max);
+}
+
+static alpha_find_fn select_alpha_find()
+{
+    SELECT_ALPHA_KERNEL(alpha_find);
+}
+
+static alpha_find_fn select_alpha_rfind()
+{
+    SELECT_ALPHA_KERNEL(alpha_rfind);
+}
+
+void extract_alpha(const uint8_t *pixels, size_t count, uint8_t *out)
+{
+    static const extract_alpha_fn impl = select_extract_alpha();
+    impl(pixels, count, out);
+}
+
+uint8_t alpha_max(const uint8_t *alpha, size_t count)
+{
+    static const alpha_max_fn impl = select_alpha_max();
+    return impl(alpha, count);
+}
+
+size_t alpha_find(const uint8_t *alpha, size_t count, uint8_t value)
+{
+    static const alpha_find_fn impl = select_alpha_find();
+    return impl(alpha, count, value);
+}
+
+size_t alpha_rfind(const uint8_t *alpha, size_t count, uint8_t value)
+{
+    static const alpha_find_fn impl = select_alpha_rfind();
+    return impl(alpha, count, value);
+}
+
+// The *_isa entry points run one alpha kernel regardless of what the
+// dispatch above would pick; every SSE variant needs only SSE2
+static bool alpha_kernel_supported(pixel_kernel_isa isa)
+{
+    switch (isa)
+    {
+    case PIXEL_KERNEL_SCALAR:
+        return true;
+#ifdef HAVE_X86_KERNELS
+    case PIXEL_KERNEL_SSE:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse2");
+    case PIXEL_KERNEL_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+#define ALPHA_KERNEL_FOR_ISA(name, isa)                  \
+    ((isa) == PIXEL_KERNEL_AVX2  ? name##_avx2           \
+     : (isa) == PIXEL_KERNEL_SSE ? name##_sse2           \
+                                 : name##_scalar)
+#else
+#define ALPHA_KERNEL_FOR_ISA(name, isa) name##_scalar
+#endif
+
+bool extract_alpha_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count, uint8_t *out)
+{
+    if (!alpha_kernel_supported(isa))
+    {
+        return false;
+    }
+    ALPHA_KERNEL_FOR_ISA(extract_alpha, isa)(pixels, count, out);
+    return true;
+}
+
+bool alpha_max_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t *result)
+{
+    if (!alpha_kernel_supported(isa))
+    {
+        return false;
+    }
+    *result = ALPHA_KERNEL_FOR_ISA(alpha_max, isa)(alpha, count);
+    return true;
+}
+
+bool alpha_find_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t value, size_t *result)
+{
+    if (!alpha_kernel_supported(isa))
+    {
+        return false;
+    }
+    *result = ALPHA_KERNEL_FOR_ISA(alpha_find, isa)(alpha, count, value);
+    return true;
+}
+
+bool alpha_rfind_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t value, size_t *result)
+{
+    if (!alpha_kernel_supported(isa))
+    {
+        return false;
+    }
+    *result = ALPHA_KERNEL_FOR_ISA(alpha_rfind, isa)(alpha, count, value);
+    return true;
+}
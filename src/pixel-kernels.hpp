@@ -0,0 +1,87 @@
+#ifndef __PIXEL_KERNELS_H_INCLUDED
+#define __PIXEL_KERNELS_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief 内核的指令集实现, 用于测试逐一验证各实现
+ */
+enum pixel_kernel_isa
+{
+    PIXEL_KERNEL_SCALAR,
+    PIXEL_KERNEL_SSE,
+    PIXEL_KERNEL_AVX2,
+};
+
+/**
+ * @brief 统计 count 个 RGBA 像素的最大灰度偏差与最小 alpha
+ *
+ * 结果与 *maxGrayDeviation / *minAlpha 原有的值合并, 因此可以逐行累积.
+ * 运行时根据 cpu 选择 AVX2/SSE2/标量实现, 各实现结果完全一致.
+ */
+extern void scan_gray_opacity(const uint8_t *pixels, size_t count,
+                              int *maxGrayDeviation, int *minAlpha);
+
+/**
+ * @brief 用指定实现执行 scan_gray_opacity, cpu 不支持该实现时返回 false
+ *
+ * PIXEL_KERNEL_SSE 对应 SSE2 实现.
+ */
+extern bool scan_gray_opacity_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count,
+                                  int *maxGrayDeviation, int *minAlpha);
+
+/**
+ * @brief 将一行 RGBA 像素压缩为灰度(withAlpha 时为灰度+alpha)
+ *
+ * luminance 为 false 时直接取 R 通道(图像本身就是灰度), 否则按
+ * 0.2126/0.7152/0.0722 计算亮度, 结果与浮点实现逐位一致.
+ */
+extern void compact_gray_row(const uint8_t *pixels, size_t count, uint8_t *out,
+                             bool luminance, bool withAlpha);
+
+/**
+ * @brief 用指定实现执行 compact_gray_row, cpu 不支持该实现时返回 false
+ *
+ * PIXEL_KERNEL_SSE 对应 SSE4.1 实现.
+ */
+extern bool compact_gray_row_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count, uint8_t *out,
+                                 bool luminance, bool withAlpha);
+
+/**
+ * @brief count 个 RGBA 像素是否都与 reference 指向的像素相同
+ *
+ * reference 的 alpha 为 0 时只要求各像素 alpha 为 0 (与 get_color 的判断一致).
+ * 按 32 位整数比较, 遇到第一个不同的像素即返回.
+ */
+extern bool pixels_uniform(const uint8_t *pixels, size_t count, const uint8_t *reference);
+
+/**
+ * @brief 取出 count 个 RGBA 像素的 alpha, 连续写入 out
+ */
+extern void extract_alpha(const uint8_t *pixels, size_t count, uint8_t *out);
+
+/**
+ * @brief alpha 平面中 count 个值的最大值, count 为 0 时为 0
+ */
+extern uint8_t alpha_max(const uint8_t *alpha, size_t count);
+
+/**
+ * @brief alpha 平面中第一个/最后一个等于 value 的位置, 找不到时返回 count
+ */
+extern size_t alpha_find(const uint8_t *alpha, size_t count, uint8_t value);
+extern size_t alpha_rfind(const uint8_t *alpha, size_t count, uint8_t value);
+
+/**
+ * @brief 用指定实现执行 extract_alpha/alpha_max/alpha_find/alpha_rfind, cpu 不支持该实现时返回 false
+ *
+ * 返回值写入 *result. PIXEL_KERNEL_SSE 对应 SSE2 实现.
+ */
+extern bool extract_alpha_isa(pixel_kernel_isa isa, const uint8_t *pixels, size_t count, uint8_t *out);
+extern bool alpha_max_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t *result);
+extern bool alpha_find_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t value,
+                           size_t *result);
+extern bool alpha_rfind_isa(pixel_kernel_isa isa, const uint8_t *alpha, size_t count, uint8_t value,
+                            size_t *result);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __SHA256_H_INCLUDED
+#define __SHA256_H_INCLUDED
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * @brief 流式 SHA-256, 用于计算缓存键
+ */
+class Sha256
+{
+public:
+    Sha256();
+
+    void update(void const *data, size_t size);
+
+    // 结束计算, 返回64位十六进制小写字符串
+    ::std::string hexdigest();
+
+private:
+    void transform(uint8_t const *block);
+
+    uint32_t state_[8];
+    uint64_t length_;
+    uint8_t buffer_[64];
+    size_t buffered_;
+};
+
+#endif
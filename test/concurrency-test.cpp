@@ -0,0 +1,185 @@
+// 多个线程同时解压, 合并与编译, 每次调用使用各自的 image_info 与 Aapt9PNGError.
+// 结果必须与单线程时逐字节相同; 以 -DAAPT9PNG_TSAN=ON 构建时由 ThreadSanitizer 检查数据竞争
+#include "9png.hpp"
+#include "9png-log.hpp"
+#include "android-bundle.hpp"
+#include <png.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef ::std::vector<uint8_t> bytes;
+
+#define THREADS 8
+#define ITERATIONS 6
+
+static bool load(::std::string const &path, bytes &out)
+{
+    ::std::ifstream stm(path, ::std::ios::binary);
+    out.assign(::std::istreambuf_iterator<char>(stm), ::std::istreambuf_iterator<char>());
+    return stm.good() || stm.eof();
+}
+
+// 把原始.9.png左边框的第一个像素改为半透明, 编译时应报告 left 边框的错误
+static bool make_malformed_source(bytes const &source, bytes &out)
+{
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, source.data(), source.size()))
+    {
+        return false;
+    }
+    image.format = PNG_FORMAT_RGBA;
+    bytes pixels(PNG_IMAGE_SIZE(image));
+    if (!png_image_finish_read(&image, NULL, pixels.data(), 0, NULL))
+    {
+        return false;
+    }
+    pixels[image.width * 4 + 3] = 128;
+
+    png_alloc_size_t size = 0;
+    if (!png_image_write_get_memory_size(image, size, 0, pixels.data(), 0, NULL))
+    {
+        return false;
+    }
+    out.resize(size);
+    return png_image_write_to_memory(&image, out.data(), &size, 0, pixels.data(), 0, NULL) != 0;
+}
+
+struct expected
+{
+    bytes json;
+    bytes png;
+    bytes encodedBest;
+    bytes encodedMax;
+    bytes compiled;
+};
+
+// 一轮全部操作; 与 want 不同时打印原因并返回 false
+static bool run_round(Aapt9PNGEncoder &encoder, bytes const &apk, bytes const &source, bytes const &malformed,
+                      Bundle const &best, Bundle const &max, expected const &want)
+{
+    bytes json, png, encoded;
+    Aapt9PNGError error;
+    if (!DecodeAapt9PNG(apk.data(), apk.size(), json, png, &best, &error) || json != want.json || png != want.png)
+    {
+        printf("decode: %s\n", error.message.c_str());
+        return false;
+    }
+
+    Aapt9PNGError metaError;
+    bytes metadata;
+    if (!DecodeAapt9PNGMetadata(apk.data(), apk.size(), metadata, &best, &metaError) || metadata != want.json)
+    {
+        printf("metadata: %s\n", metaError.message.c_str());
+        return false;
+    }
+
+    Aapt9PNGError bestError;
+    if (!encoder.encode(encoded, json.data(), json.size(), png.data(), png.size(), &best, &bestError) ||
+        encoded != want.encodedBest)
+    {
+        printf("encode best: %s\n", bestError.message.c_str());
+        return false;
+    }
+
+    // COMPRESSION_MAX 的压缩尝试在每次调用内部再开线程, 共享同一个 image_info
+    Aapt9PNGError maxError;
+    if (!encoder.encode(encoded, json.data(), json.size(), png.data(), png.size(), &max, &maxError) ||
+        encoded != want.encodedMax)
+    {
+        printf("encode max: %s\n", maxError.message.c_str());
+        return false;
+    }
+
+    Aapt9PNGError compileError;
+    if (!encoder.compile(encoded, source.data(), source.size(), &best, &compileError) || encoded != want.compiled)
+    {
+        printf("compile: %s\n", compileError.message.c_str());
+        return false;
+    }
+
+    // 失败的调用只在自己的 error 中报告, 不影响其它线程
+    Aapt9PNGError frameError;
+    if (encoder.compile(encoded, malformed.data(), malformed.size(), &best, &frameError) ||
+        frameError.code != AAPT9PNG_ERROR_MALFORMED || frameError.edge != "left")
+    {
+        printf("malformed compile: code=%d edge=%s\n", frameError.code, frameError.edge.c_str());
+        return false;
+    }
+
+    Aapt9PNGError truncatedError;
+    if (DecodeAapt9PNG(apk.data(), apk.size() / 2, json, png, &best, &truncatedError) ||
+        truncatedError.code == AAPT9PNG_OK)
+    {
+        printf("truncated decode did not fail\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <test dir>\n", argv[0]);
+        return 2;
+    }
+    ::std::string dir = argv[1];
+
+    bytes apk, source, malformed;
+    if (!load(dir + "/test-gs-apk.9.png", apk) || !load(dir + "/test-gs.9.png", source) ||
+        !make_malformed_source(source, malformed))
+    {
+        printf("can't load test images from %s\n", dir.c_str());
+        return 2;
+    }
+
+    Bundle best;
+    Bundle max;
+    max.compressionProfile = COMPRESSION_MAX;
+    max.trialThreads = 4;
+
+    // 单线程时的结果作为基准
+    expected want;
+    Aapt9PNGEncoder encoder;
+    if (!DecodeAapt9PNG(apk.data(), apk.size(), want.json, want.png, &best) ||
+        !encoder.encode(want.encodedBest, want.json.data(), want.json.size(), want.png.data(), want.png.size(), &best) ||
+        !encoder.encode(want.encodedMax, want.json.data(), want.json.size(), want.png.data(), want.png.size(), &max) ||
+        !encoder.compile(want.compiled, source.data(), source.size(), &best) || want.compiled != apk)
+    {
+        printf("single-threaded reference failed\n");
+        return 1;
+    }
+
+    ::std::atomic<int> failures(0);
+    ::std::vector<::std::thread> pool;
+    for (int t = 0; t < THREADS; t++)
+    {
+        pool.emplace_back([&, t]() {
+            Aapt9PNGEncoder local;
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                // 日志级别是唯一的全局设置, 与调用同时修改也不能产生竞争
+                SetAapt9PNGLogLevel((t + i) % 2 ? AAPT9PNG_LOG_OFF : AAPT9PNG_LOG_WARN);
+                if (!run_round(local, apk, source, malformed, best, max, want))
+                {
+                    failures++;
+                }
+            }
+        });
+    }
+    for (auto &th : pool)
+    {
+        th.join();
+    }
+
+    printf("%d threads x %d rounds, %d failures\n", THREADS, ITERATIONS, failures.load());
+    return failures ? 1 : 0;
+}
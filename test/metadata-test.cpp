@@ -0,0 +1,132 @@
+// 编码时对 .9 信息的检查: 分割点, 内边距与颜色数不符的 json 必须以 AAPT9PNG_ERROR_METADATA 拒绝.
+// 每种情况都走两条路径: 输入已是aapt处理过的.9.png (只替换 chunk), 以及普通 png (完整编码).
+// 另外在小数点为逗号的 locale 下解压与编码, json 必须不变并能还原 outline 的 radius
+#include "9png.hpp"
+#include "android-bundle.hpp"
+#include <cstdio>
+#include <clocale>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+typedef ::std::vector<uint8_t> bytes;
+
+static bool load(::std::string const &path, bytes &out)
+{
+    ::std::ifstream stm(path, ::std::ios::binary);
+    out.assign(::std::istreambuf_iterator<char>(stm), ::std::istreambuf_iterator<char>());
+    return stm.good() || stm.eof();
+}
+
+// 把 json 中的 from 替换为 to, from 必须存在
+static ::std::string patch_json(::std::string json, char const *from, char const *to)
+{
+    size_t at = json.find(from);
+    if (at == ::std::string::npos)
+    {
+        printf("test json has no %s: %s\n", from, json.c_str());
+        return ::std::string();
+    }
+    return json.replace(at, strlen(from), to);
+}
+
+// 在 de_DE.UTF-8 下重新解压, json 必须与 C locale 下逐字节相同, 再编码必须得到原文件.
+// 系统没有安装该 locale 时跳过
+static int check_numeric_locale(bytes const &apk, bytes const &want, Bundle const &bundle)
+{
+    ::std::string saved = setlocale(LC_NUMERIC, NULL);
+    if (!setlocale(LC_NUMERIC, "de_DE.UTF-8"))
+    {
+        printf("numeric locale skipped (de_DE.UTF-8 not installed)\n");
+        return 0;
+    }
+
+    int failures = 0;
+    bytes json, png, output;
+    Aapt9PNGEncoder encoder;
+    if (!DecodeAapt9PNG(apk.data(), apk.size(), json, png, &bundle) || json != want)
+    {
+        printf("numeric locale: decoded json differs: %.*s\n", (int)json.size(), (char const *)json.data());
+        failures++;
+    }
+    else if (!encoder.encode(output, json.data(), json.size(), png.data(), png.size(), &bundle) || output != apk)
+    {
+        printf("numeric locale: encoding the decoded json did not reproduce the original\n");
+        failures++;
+    }
+    setlocale(LC_NUMERIC, saved.c_str());
+    return failures;
+}
+
+struct metadata_case
+{
+    char const *name;
+    char const *from;
+    char const *to;
+    bool accepted;
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <test dir>\n", argv[0]);
+        return 2;
+    }
+    ::std::string dir = argv[1];
+
+    bytes apk, json, png;
+    Bundle bundle;
+    if (!load(dir + "/test-gs-apk.9.png", apk) || !DecodeAapt9PNG(apk.data(), apk.size(), json, png, &bundle))
+    {
+        printf("can't decode %s/test-gs-apk.9.png\n", dir.c_str());
+        return 2;
+    }
+    ::std::string original(json.begin(), json.end());
+
+    // test-gs-apk.9.png 的分割为 xDivs [22,35], yDivs [18,27], 共 3x3 个色块
+    static const metadata_case cases[] = {
+        {"original", "", "", true},
+        {"leading zero div", "\"xDivs\":[22,35]", "\"xDivs\":[0,22,35]", true},
+        {"too few colors", "[1,1,1,1,0,1,1,1,1]", "[1,1,1,1,0,1,1,1]", false},
+        {"too many colors", "[1,1,1,1,0,1,1,1,1]", "[1,1,1,1,0,1,1,1,1,1]", false},
+        {"extra div", "\"xDivs\":[22,35]", "\"xDivs\":[22,35,35]", false},
+        {"div out of range", "\"yDivs\":[18,27]", "\"yDivs\":[18,100000]", false},
+        {"decreasing divs", "\"yDivs\":[18,27]", "\"yDivs\":[27,18]", false},
+        {"negative padding", "\"left\":21", "\"left\":-1", false},
+    };
+
+    int failures = 0;
+    Aapt9PNGEncoder encoder;
+    for (metadata_case const &c : cases)
+    {
+        ::std::string text = *c.from ? patch_json(original, c.from, c.to) : original;
+        if (text.empty())
+        {
+            return 2;
+        }
+
+        bytes const *inputs[] = {&apk, &png};
+        char const *paths[] = {"rewrite", "encode"};
+        for (int i = 0; i < 2; i++)
+        {
+            bytes output;
+            Aapt9PNGError error;
+            bool ok = encoder.encode(output, (uint8_t const *)text.data(), text.size(),
+                                     inputs[i]->data(), inputs[i]->size(), &bundle, &error);
+            bool rejected = !ok && error.code == AAPT9PNG_ERROR_METADATA;
+            if (c.accepted ? !ok : !rejected)
+            {
+                printf("%s (%s): ok=%d code=%d %s\n", c.name, paths[i], ok, error.code, error.message.c_str());
+                failures++;
+            }
+        }
+    }
+
+    failures += check_numeric_locale(apk, json, bundle);
+
+    printf("%d cases, %d failures\n", (int)(sizeof(cases) / sizeof(cases[0])), failures);
+    return failures ? 1 : 0;
+}
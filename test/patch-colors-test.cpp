@@ -0,0 +1,248 @@
+// get_patch_colors 必须与逐个色块调用 get_color 的结果完全相同.
+// 覆盖 test/ 中的图片, 以及随机的分割, 纯色/透明色块与单个不同的像素
+#include "android-images.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+// 一张去掉边框的 RGBA 图片, 以及与 rows 同一原点的 alpha 平面
+struct test_image
+{
+    int width;
+    int height;
+    ::std::vector<png_byte> pixels;
+    ::std::vector<png_bytep> rows;
+    size_t alphaStride;
+    ::std::vector<png_byte> alpha;
+
+    void allocate(int w, int h)
+    {
+        width = w;
+        height = h;
+        pixels.assign((size_t)w * h * 4, 0);
+        rows.resize(h);
+        for (int y = 0; y < h; y++)
+        {
+            rows[y] = &pixels[(size_t)y * w * 4];
+        }
+    }
+
+    // 每行之后留出几个字节, 检查 alphaStride 的使用
+    void build_alpha()
+    {
+        alphaStride = width + 3;
+        alpha.assign(alphaStride * height, 0xff);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                alpha[y * alphaStride + x] = rows[y][x * 4 + 3];
+            }
+        }
+    }
+};
+
+// 与 do_9patch 相同的方式把分割点展开为 [start, end) 区间
+static void make_ranges(::std::vector<int32_t> const &divs, int size, ::std::vector<int32_t> &ranges)
+{
+    ranges.clear();
+    int start = 0;
+    for (size_t i = (!divs.empty() && divs[0] == 0) ? 1 : 0; i <= divs.size() && start < size; i++)
+    {
+        int end = i == divs.size() ? size : divs[i];
+        ranges.push_back(start);
+        ranges.push_back(end);
+        start = end;
+    }
+}
+
+static int check_layout(test_image &image, ::std::vector<int32_t> const &xDivs, ::std::vector<int32_t> const &yDivs,
+                        char const *name)
+{
+    ::std::vector<int32_t> cols, patchRows;
+    make_ranges(xDivs, image.width, cols);
+    make_ranges(yDivs, image.height, patchRows);
+    int numCols = (int)cols.size() / 2;
+    int numRows = (int)patchRows.size() / 2;
+    if (numCols * numRows > 0x7f)
+    {
+        return 0;
+    }
+
+    image.build_alpha();
+    ::std::vector<uint32_t> fast(numCols * numRows);
+    ::std::vector<uint32_t> rowsOnly(numCols * numRows);
+    get_patch_colors(image.rows.data(), image.alpha.data(), image.alphaStride,
+                     cols.data(), numCols, patchRows.data(), numRows, fast.data());
+    get_patch_colors(image.rows.data(), NULL, 0,
+                     cols.data(), numCols, patchRows.data(), numRows, rowsOnly.data());
+
+    for (int r = 0; r < numRows; r++)
+    {
+        for (int c = 0; c < numCols; c++)
+        {
+            uint32_t want = get_color(image.rows.data(), cols[2 * c], patchRows[2 * r],
+                                      cols[2 * c + 1] - 1, patchRows[2 * r + 1] - 1);
+            uint32_t got = fast[r * numCols + c];
+            uint32_t gotRows = rowsOnly[r * numCols + c];
+            if (got != want || gotRows != want)
+            {
+                printf("%s: cell (%d,%d) x=[%d,%d) y=[%d,%d): got #%08x (rows only #%08x), get_color #%08x\n",
+                       name, c, r, cols[2 * c], cols[2 * c + 1], patchRows[2 * r], patchRows[2 * r + 1],
+                       got, gotRows, want);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// 读取原始.9.png, 边框上的黑色像素给出分割点, 去掉边框后的像素写入 image
+static bool load_source_9patch(char const *path, test_image &image,
+                               ::std::vector<int32_t> &xDivs, ::std::vector<int32_t> &yDivs)
+{
+    png_image png;
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&png, path))
+    {
+        return false;
+    }
+    png.format = PNG_FORMAT_RGBA;
+    int W = png.width, H = png.height;
+    ::std::vector<png_byte> frame(PNG_IMAGE_SIZE(png));
+    if (!png_image_finish_read(&png, NULL, frame.data(), 0, NULL) || W < 3 || H < 3)
+    {
+        return false;
+    }
+
+    auto black = [&](int x, int y) {
+        png_byte const *p = &frame[((size_t)y * W + x) * 4];
+        return p[0] == 0 && p[1] == 0 && p[2] == 0 && p[3] == 0xff;
+    };
+    auto ticks = [&](int count, bool horizontal, ::std::vector<int32_t> &divs) {
+        divs.clear();
+        bool inside = false;
+        for (int i = 0; i < count; i++)
+        {
+            bool tick = horizontal ? black(i + 1, 0) : black(0, i + 1);
+            if (tick != inside)
+            {
+                divs.push_back(i);
+                inside = tick;
+            }
+        }
+        if (inside)
+        {
+            divs.push_back(count);
+        }
+    };
+    ticks(W - 2, true, xDivs);
+    ticks(H - 2, false, yDivs);
+
+    image.allocate(W - 2, H - 2);
+    for (int y = 0; y < image.height; y++)
+    {
+        memcpy(image.rows[y], &frame[((size_t)(y + 1) * W + 1) * 4], (size_t)image.width * 4);
+    }
+    return true;
+}
+
+static void random_divs(::std::mt19937 &rng, int size, ::std::vector<int32_t> &divs)
+{
+    divs.clear();
+    int count = 2 * (1 + rng() % 4);
+    for (int i = 0; i < count; i++)
+    {
+        divs.push_back(rng() % (size + 1));
+    }
+    ::std::sort(divs.begin(), divs.end());
+}
+
+// 每个色块填充一种颜色 (部分为 alpha 0 但 RGB 各异), 再随机改动一些像素
+static void random_image(::std::mt19937 &rng, test_image &image,
+                         ::std::vector<int32_t> const &xDivs, ::std::vector<int32_t> const &yDivs)
+{
+    ::std::vector<int32_t> cols, patchRows;
+    make_ranges(xDivs, image.width, cols);
+    make_ranges(yDivs, image.height, patchRows);
+    for (size_t r = 0; r < patchRows.size(); r += 2)
+    {
+        for (size_t c = 0; c < cols.size(); c += 2)
+        {
+            uint32_t color = rng();
+            bool transparent = rng() % 3 == 0;
+            for (int y = patchRows[r]; y < patchRows[r + 1]; y++)
+            {
+                for (int x = cols[c]; x < cols[c + 1]; x++)
+                {
+                    png_bytep p = image.rows[y] + x * 4;
+                    p[0] = (png_byte)color;
+                    p[1] = (png_byte)(color >> 8);
+                    p[2] = (png_byte)(color >> 16);
+                    p[3] = transparent ? 0 : (png_byte)(color >> 24);
+                    if (transparent)
+                    {
+                        // 透明像素的 RGB 不影响颜色
+                        p[0] = (png_byte)rng();
+                    }
+                }
+            }
+        }
+    }
+
+    int changes = rng() % 4;
+    for (int i = 0; i < changes; i++)
+    {
+        png_bytep p = image.rows[rng() % image.height] + (rng() % image.width) * 4;
+        p[rng() % 4] ^= (png_byte)(1 << (rng() % 8));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <test dir>\n", argv[0]);
+        return 2;
+    }
+    ::std::string dir = argv[1];
+
+    test_image image;
+    ::std::vector<int32_t> xDivs, yDivs;
+    if (!load_source_9patch((dir + "/test-gs.9.png").c_str(), image, xDivs, yDivs))
+    {
+        printf("can't load %s/test-gs.9.png\n", dir.c_str());
+        return 2;
+    }
+
+    int failures = check_layout(image, xDivs, yDivs, "test-gs.9.png");
+
+    // 同一张图片上的随机分割
+    ::std::mt19937 rng(9);
+    for (int i = 0; i < 2000 && !failures; i++)
+    {
+        ::std::vector<int32_t> x, y;
+        random_divs(rng, image.width, x);
+        random_divs(rng, image.height, y);
+        failures += check_layout(image, x, y, "test-gs.9.png (random divs)");
+    }
+
+    // 随机图片: 尺寸覆盖向量宽度的尾部
+    int rounds = 0;
+    for (; rounds < 5000 && !failures; rounds++)
+    {
+        test_image random;
+        random.allocate(1 + rng() % 80, 1 + rng() % 40);
+        random_divs(rng, random.width, xDivs);
+        random_divs(rng, random.height, yDivs);
+        random_image(rng, random, xDivs, yDivs);
+        failures += check_layout(random, xDivs, yDivs, "random");
+    }
+
+    printf("%d random images, %d failures\n", rounds, failures);
+    return failures ? 1 : 0;
+}
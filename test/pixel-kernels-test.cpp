@@ -0,0 +1,233 @@
+// 每个内核的各个指令集实现都必须与标量实现(compact_gray_row 为浮点亮度公式)逐位一致.
+// 行长度与起始偏移覆盖向量尾部与未对齐的地址
+#include "pixel-kernels.hpp"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static uint8_t reference_luminance(int rr, int gg, int bb)
+{
+    return (uint8_t)(rr * 0.2126f + gg * 0.7152f + bb * 0.0722f);
+}
+
+static const char *isa_name(pixel_kernel_isa isa)
+{
+    switch (isa)
+    {
+    case PIXEL_KERNEL_SCALAR:
+        return "scalar";
+    case PIXEL_KERNEL_SSE:
+        return "sse";
+    case PIXEL_KERNEL_AVX2:
+        return "avx2";
+    }
+    return "?";
+}
+
+// 遍历全部 2^24 个 RGB 组合, 按不同行长度分段
+static int check_compact_gray_row(pixel_kernel_isa isa, bool luminance, bool withAlpha)
+{
+    static const size_t rowLengths[] = {1, 3, 7, 8, 15, 16, 17, 31, 33, 4093};
+    const size_t total = (size_t)1 << 24;
+    const size_t maxRow = 4093;
+
+    ::std::vector<uint8_t> pixels(maxRow * 4);
+    ::std::vector<uint8_t> out(maxRow * 2);
+
+    size_t next = 0;
+    for (size_t pass = 0; next < total; pass++)
+    {
+        size_t count = rowLengths[pass % (sizeof(rowLengths) / sizeof(rowLengths[0]))];
+        if (count > total - next)
+        {
+            count = total - next;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t rgb = (uint32_t)(next + i);
+            pixels[i * 4 + 0] = (uint8_t)(rgb >> 16);
+            pixels[i * 4 + 1] = (uint8_t)(rgb >> 8);
+            pixels[i * 4 + 2] = (uint8_t)rgb;
+            pixels[i * 4 + 3] = (uint8_t)(rgb * 31 + 7);
+        }
+
+        if (!compact_gray_row_isa(isa, pixels.data(), count, out.data(), luminance, withAlpha))
+        {
+            printf("%-7s compact_gray_row skipped (not supported by this cpu)\n", isa_name(isa));
+            return 0;
+        }
+
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t *p = &pixels[i * 4];
+            uint8_t gray = luminance ? reference_luminance(p[0], p[1], p[2]) : p[0];
+            size_t at = withAlpha ? i * 2 : i;
+            if (out[at] != gray || (withAlpha && out[at + 1] != p[3]))
+            {
+                printf("%-7s compact_gray_row luminance=%d withAlpha=%d: rgb(%d,%d,%d) gave %d, expected %d\n",
+                       isa_name(isa), luminance, withAlpha, p[0], p[1], p[2], out[at], gray);
+                return 1;
+            }
+        }
+        next += count;
+    }
+    printf("%-7s compact_gray_row luminance=%d withAlpha=%d ok\n", isa_name(isa), luminance, withAlpha);
+    return 0;
+}
+
+// 长度 1..80 覆盖两个 AVX2 展开块 (每块 32 像素) 以内的所有尾部, 起始地址偏移 0..3 字节.
+// 像素的灰度偏差集中在 0..3 附近 (接近常用的容差), alpha 为全 0, 全 255 或混合
+static int check_scan_gray_opacity(pixel_kernel_isa isa)
+{
+    ::std::mt19937 rng(4);
+    ::std::vector<uint8_t> buffer(80 * 4 + 4);
+
+    for (int round = 0; round < 24000; round++)
+    {
+        size_t count = 1 + round % 80;
+        size_t offset = (round / 80) % 4;
+        int alphaMode = (round / 320) % 3;
+        uint8_t *pixels = buffer.data() + offset;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint8_t *p = pixels + i * 4;
+            int gray = rng() % 256;
+            bool wide = rng() % 16 == 0;
+            for (int k = 0; k < 3; k++)
+            {
+                int channel = wide ? (int)(rng() % 256) : gray + (int)(rng() % 7) - 3;
+                p[k] = (uint8_t)(channel < 0 ? 0 : channel > 255 ? 255 : channel);
+            }
+            p[3] = alphaMode == 0 ? 0 : alphaMode == 1 ? 255 : (uint8_t)rng();
+        }
+
+        // 先前累积的值也要参与合并
+        int startDev = round % 5 == 0 ? (int)(rng() % 8) : 0;
+        int startAlpha = round % 7 == 0 ? (int)(rng() % 256) : 255;
+        int wantDev = startDev, wantAlpha = startAlpha;
+        int gotDev = startDev, gotAlpha = startAlpha;
+        scan_gray_opacity_isa(PIXEL_KERNEL_SCALAR, pixels, count, &wantDev, &wantAlpha);
+        if (!scan_gray_opacity_isa(isa, pixels, count, &gotDev, &gotAlpha))
+        {
+            printf("%-7s scan_gray_opacity skipped (not supported by this cpu)\n", isa_name(isa));
+            return 0;
+        }
+        if (gotDev != wantDev || gotAlpha != wantAlpha)
+        {
+            printf("%-7s scan_gray_opacity count=%d offset=%d: got (%d, %d), scalar (%d, %d)\n",
+                   isa_name(isa), (int)count, (int)offset, gotDev, gotAlpha, wantDev, wantAlpha);
+            return 1;
+        }
+    }
+    printf("%-7s scan_gray_opacity ok\n", isa_name(isa));
+    return 0;
+}
+
+// alpha 内核: 长度 0..100 覆盖短于一个向量的尾部与多个 AVX2 块, 起始地址偏移 0..31 字节.
+// 要查找的值放在第一个字节, 最后一个字节, 中间, 或者不出现
+static int check_alpha_kernels(pixel_kernel_isa isa)
+{
+    ::std::mt19937 rng(25);
+    ::std::vector<uint8_t> pixelBuffer(100 * 4 + 32);
+    ::std::vector<uint8_t> alphaBuffer(100 + 32);
+    ::std::vector<uint8_t> out(100 + 1);
+
+    for (int round = 0; round < 20000; round++)
+    {
+        size_t count = round % 101;
+        size_t offset = (round / 101) % 32;
+        uint8_t *pixels = pixelBuffer.data() + offset;
+        uint8_t *alpha = alphaBuffer.data() + offset;
+
+        // 值集中在少数几个 alpha 上, 最大值可能出现在任意位置
+        for (size_t i = 0; i < count * 4; i++)
+        {
+            pixels[i] = (uint8_t)rng();
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            alpha[i] = (uint8_t)(rng() % 4 == 0 ? rng() : rng() % 3);
+        }
+        uint8_t needle = 0xc8;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (alpha[i] == needle)
+            {
+                alpha[i]--;
+            }
+        }
+        int placement = (round / (101 * 32)) % 4;
+        if (count > 0 && placement == 0)
+        {
+            alpha[0] = needle;
+        }
+        else if (count > 0 && placement == 1)
+        {
+            alpha[count - 1] = needle;
+        }
+        else if (count > 0 && placement == 2)
+        {
+            alpha[rng() % count] = needle;
+        }
+
+        out[count] = 0x5a;
+        if (!extract_alpha_isa(isa, pixels, count, out.data()))
+        {
+            printf("%-7s alpha kernels skipped (not supported by this cpu)\n", isa_name(isa));
+            return 0;
+        }
+        for (size_t i = 0; i <= count; i++)
+        {
+            uint8_t want = i < count ? pixels[i * 4 + 3] : 0x5a;
+            if (out[i] != want)
+            {
+                printf("%-7s extract_alpha count=%d offset=%d: out[%d]=%d, expected %d\n",
+                       isa_name(isa), (int)count, (int)offset, (int)i, out[i], want);
+                return 1;
+            }
+        }
+
+        uint8_t wantMax = 0;
+        size_t wantFirst = count, wantLast = count;
+        for (size_t i = 0; i < count; i++)
+        {
+            wantMax = alpha[i] > wantMax ? alpha[i] : wantMax;
+            if (alpha[i] == needle)
+            {
+                wantFirst = wantFirst == count ? i : wantFirst;
+                wantLast = i;
+            }
+        }
+        uint8_t gotMax = 0;
+        size_t gotFirst = 0, gotLast = 0;
+        alpha_max_isa(isa, alpha, count, &gotMax);
+        alpha_find_isa(isa, alpha, count, needle, &gotFirst);
+        alpha_rfind_isa(isa, alpha, count, needle, &gotLast);
+        if (gotMax != wantMax || gotFirst != wantFirst || gotLast != wantLast)
+        {
+            printf("%-7s alpha count=%d offset=%d: max %d find %d rfind %d, expected %d %d %d\n",
+                   isa_name(isa), (int)count, (int)offset, gotMax, (int)gotFirst, (int)gotLast,
+                   wantMax, (int)wantFirst, (int)wantLast);
+            return 1;
+        }
+    }
+    printf("%-7s alpha kernels ok\n", isa_name(isa));
+    return 0;
+}
+
+int main()
+{
+    static const pixel_kernel_isa isas[] = {PIXEL_KERNEL_SCALAR, PIXEL_KERNEL_SSE, PIXEL_KERNEL_AVX2};
+
+    int failures = 0;
+    for (pixel_kernel_isa isa : isas)
+    {
+        for (int mode = 0; mode < 4; mode++)
+        {
+            failures += check_compact_gray_row(isa, (mode & 1) != 0, (mode & 2) != 0);
+        }
+        failures += check_scan_gray_opacity(isa);
+        failures += check_alpha_kernels(isa);
+    }
+    return failures ? 1 : 0;
+}